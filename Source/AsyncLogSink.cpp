@@ -0,0 +1,179 @@
+﻿#include <cstdio>
+#include <ctime>
+#include "AsyncLogSink.h"
+#include "spdlog/details/os.h"
+
+AsyncLogSink::AsyncLogSink(const std::vector<spdlog::sink_ptr>& sinks_, int queueSize, LogOverflowPolicy policy_) :
+    sinks(sinks_), policy(policy_), ring(queueSize > 0 ? queueSize : 1), head(0), size(0),
+    numQueued(0), numDone(0), stopping(false), dropped(0), numErrors(0)
+{
+    writer = std::thread(&AsyncLogSink::run, this);
+}
+
+AsyncLogSink::~AsyncLogSink()
+{
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        stopping = true;
+    }
+    notEmpty.notify_one();
+    writer.join();
+    flushSinks();
+}
+
+void AsyncLogSink::log(const spdlog::details::log_msg& msg)
+{
+    int capacity = (int)ring.size();
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (size == capacity)
+        {
+            if (policy == LOG_OVERFLOW_DROP_NEWEST)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else if (policy == LOG_OVERFLOW_DROP_OLDEST)
+            {
+                head = (head + 1) % capacity;
+                size--;
+                numDone++;
+                dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+                notFull.wait(lock, [this, capacity] { return size < capacity; });
+        }
+        ring[(head + size) % capacity].assign(msg);
+        size++;
+        numQueued++;
+    }
+    notEmpty.notify_one();
+}
+
+void AsyncLogSink::flush()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        unsigned long long int target = numQueued;
+        drained.wait(lock, [this, target] { return numDone >= target; });
+    }
+    flushSinks();
+}
+
+void AsyncLogSink::set_pattern(const std::string& pattern)
+{
+    for (const spdlog::sink_ptr& sink : sinks)
+        sink->set_pattern(pattern);
+}
+
+void AsyncLogSink::set_formatter(std::unique_ptr<spdlog::formatter> sinkFormatter)
+{
+    for (const spdlog::sink_ptr& sink : sinks)
+        sink->set_formatter(sinkFormatter->clone());
+}
+
+void AsyncLogSink::run()
+{
+    int capacity = (int)ring.size();
+    // Never shrunk, so that the buffers swapped out of the ring are kept.
+    std::vector<QueuedMessage> batch(capacity);
+    int batchSize = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            notEmpty.wait(lock, [this] { return size > 0 || stopping; });
+            if (size == 0)
+                break;
+
+            // Swap queued messages out, so that the lock is not held while writing.
+            batchSize = size;
+            for (int i = 0; i < size; i++)
+                std::swap(batch[i], ring[(head + i) % capacity]);
+            head = (head + size) % capacity;
+            size = 0;
+        }
+        notFull.notify_all();
+
+        for (int i = 0; i < batchSize; i++)
+            writeMessage(batch[i].get());
+
+        {
+            std::lock_guard<std::mutex> lg(mtx);
+            numDone += batchSize;
+        }
+        drained.notify_all();
+    }
+}
+
+void AsyncLogSink::QueuedMessage::assign(const spdlog::details::log_msg& msg_)
+{
+    msg = msg_;
+    nameSize = msg_.logger_name.size();
+    buf.clear();
+    buf.append(msg_.logger_name.begin(), msg_.logger_name.end());
+    buf.append(msg_.payload.begin(), msg_.payload.end());
+}
+
+spdlog::details::log_msg AsyncLogSink::QueuedMessage::get()
+{
+    msg.logger_name = spdlog::string_view_t(buf.data(), nameSize);
+    msg.payload = spdlog::string_view_t(buf.data() + nameSize, buf.size() - nameSize);
+    return msg;
+}
+
+void AsyncLogSink::writeMessage(const spdlog::details::log_msg& msg)
+{
+    for (const spdlog::sink_ptr& sink : sinks)
+    {
+        if (!sink->should_log(msg.level))
+            continue;
+        try
+        {
+            sink->log(msg);
+        }
+        catch (const std::exception& e)
+        {
+            reportError(e.what());
+        }
+        catch (...)
+        {
+            reportError("Unknown exception in async log sink");
+        }
+    }
+}
+
+void AsyncLogSink::flushSinks()
+{
+    for (const spdlog::sink_ptr& sink : sinks)
+    {
+        try
+        {
+            sink->flush();
+        }
+        catch (const std::exception& e)
+        {
+            reportError(e.what());
+        }
+        catch (...)
+        {
+            reportError("Unknown exception in async log sink");
+        }
+    }
+}
+
+// Same format and rate as the default error handler of spdlog::logger.
+void AsyncLogSink::reportError(const char* what)
+{
+    std::lock_guard<std::mutex> lg(errorMtx);
+    numErrors++;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (numErrors > 1 && now - lastErrorTime < std::chrono::seconds(1))
+        return;
+    lastErrorTime = now;
+
+    std::tm tm = spdlog::details::os::localtime();
+    char date[64];
+    std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(stderr, "[*** LOG ERROR #%04llu ***] [%s] [async] {%s}\n", numErrors, date, what);
+}
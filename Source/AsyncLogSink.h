@@ -0,0 +1,77 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Log.h"
+#include "spdlog/sinks/sink.h"
+#include "spdlog/details/log_msg.h"
+
+// Sink forwarding messages to other sinks from a dedicated writer thread.
+// Log calls only copy the message into a bounded ring queue, so the calling threads
+// never wait for formatting or file I/O, unless the queue is full with LOG_OVERFLOW_BLOCK.
+// Messages are written in the order they were queued. flush() waits until every message
+// queued before it has been written. The destructor writes out what remains in the queue.
+// Exceptions thrown by the wrapped sinks are caught and reported on stderr at most once per
+// second, as spdlog::logger does, so that e.g. a full disk does not end the writer thread.
+class AsyncLogSink : public spdlog::sinks::sink
+{
+public:
+    AsyncLogSink(const std::vector<spdlog::sink_ptr>& sinks_, int queueSize = 8192,
+        LogOverflowPolicy policy_ = LOG_OVERFLOW_BLOCK);
+    ~AsyncLogSink();
+
+    void log(const spdlog::details::log_msg& msg) override;
+    void flush() override;
+    void set_pattern(const std::string& pattern) override;
+    void set_formatter(std::unique_ptr<spdlog::formatter> sinkFormatter) override;
+
+    // Number of messages discarded because the queue was full.
+    unsigned long long int numDropped() const
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    AsyncLogSink(const AsyncLogSink&);
+    AsyncLogSink& operator=(const AsyncLogSink&);
+
+    // Copy of a log_msg owning its logger name and payload. The buffer is reused by
+    // the next message queued in the same slot, so a warm queue does not allocate.
+    struct QueuedMessage
+    {
+        void assign(const spdlog::details::log_msg& msg_);
+        // The string views of msg point into buf, which may move, so they are only
+        // set when the message is written.
+        spdlog::details::log_msg get();
+
+        spdlog::details::log_msg msg;
+        size_t nameSize;
+        spdlog::memory_buf_t buf;
+    };
+
+    void run();
+    void writeMessage(const spdlog::details::log_msg& msg);
+    void flushSinks();
+    void reportError(const char* what);
+
+    std::vector<spdlog::sink_ptr> sinks;
+    LogOverflowPolicy policy;
+    std::vector<QueuedMessage> ring;
+    int head, size;
+    // Messages queued so far, and messages written or dropped from the queue so far.
+    unsigned long long int numQueued, numDone;
+    bool stopping;
+    std::atomic<unsigned long long int> dropped;
+    // Sink errors so far, and the last time one was reported, under errorMtx.
+    unsigned long long int numErrors;
+    std::chrono::steady_clock::time_point lastErrorTime;
+    std::mutex errorMtx;
+    std::mutex mtx;
+    std::condition_variable notEmpty, notFull, drained;
+    std::thread writer;
+};
@@ -0,0 +1,250 @@
+﻿#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdio>
+#include <algorithm>
+#include "BinaryLog.h"
+#include "spdlog/details/os.h"
+
+static std::mutex registryMtx;
+static std::vector<const BinaryLogSite*> sites;
+
+static std::mutex mtx;
+static std::condition_variable stopCond;
+static std::thread writer;
+static bool stopping = false;
+static FILE* file = 0;
+static int bufferSize = 1 << 20;
+static std::atomic<bool> running(false);
+static std::atomic<BinaryLogBuffer*> buffers(0);
+static std::atomic<unsigned int> generation(0);
+static std::atomic<unsigned long long int> dropped(0);
+static unsigned int numSitesWritten = 0;
+
+// Buffer of the calling thread, retired when the thread exits so that the writer frees it
+// once its last records are written out.
+struct BinaryLogBufferOwner
+{
+    ~BinaryLogBufferOwner()
+    {
+        if (buffer)
+            buffer->retired.store(true, std::memory_order_release);
+        buffer = 0;
+    }
+
+    BinaryLogBuffer* buffer;
+};
+static thread_local BinaryLogBufferOwner localBuffer = { 0 };
+
+// Shut the logger down at exit if the program did not, so that the buffers are written out
+// and the writer thread is joined before it is destroyed. Defined after the state above,
+// so it is destroyed before it.
+struct BinaryLoggerExitGuard
+{
+    ~BinaryLoggerExitGuard()
+    {
+        shutdownBinaryLogger();
+    }
+};
+static BinaryLoggerExitGuard exitGuard;
+
+std::atomic<int> binaryLogLevel(spdlog::level::trace);
+
+BinaryLogSite::BinaryLogSite(const char* file_, int line_, const char* function_,
+    spdlog::level::level_enum level_, const char* format_) :
+    file(file_), line(line_), function(function_), level(level_), format(format_)
+{
+    std::lock_guard<std::mutex> lg(registryMtx);
+    id = (unsigned int)sites.size();
+    sites.push_back(this);
+}
+
+BinaryLogBuffer* binaryLogLocalBuffer()
+{
+    if (!running.load(std::memory_order_acquire))
+        return 0;
+    unsigned int curGeneration = generation.load(std::memory_order_relaxed);
+    if (localBuffer.buffer)
+    {
+        if (localBuffer.buffer->generation == curGeneration)
+            return localBuffer.buffer;
+        // Left from before the logger was restarted.
+        localBuffer.buffer->retired.store(true, std::memory_order_release);
+    }
+
+    BinaryLogBuffer* buffer = new BinaryLogBuffer;
+    buffer->data.resize(bufferSize);
+    buffer->head.store(0, std::memory_order_relaxed);
+    buffer->tail.store(0, std::memory_order_relaxed);
+    buffer->retired.store(false, std::memory_order_relaxed);
+    buffer->threadId = spdlog::details::os::thread_id();
+    buffer->generation = curGeneration;
+    buffer->next = buffers.load(std::memory_order_relaxed);
+    while (!buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    localBuffer.buffer = buffer;
+    return buffer;
+}
+
+void countDroppedBinaryLog()
+{
+    dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+unsigned long long int numDroppedBinaryLogs()
+{
+    return dropped.load(std::memory_order_relaxed);
+}
+
+static void writeU32(unsigned int val)
+{
+    fwrite(&val, 4, 1, file);
+}
+
+static void writeString(const char* str)
+{
+    unsigned int len = (unsigned int)strlen(str);
+    writeU32(len);
+    fwrite(str, 1, len, file);
+}
+
+// Unlink a retired buffer from the list and free it. Only the writer removes buffers,
+// threads only push new ones in front.
+static void freeBuffer(BinaryLogBuffer* buffer)
+{
+    BinaryLogBuffer* head = buffer;
+    if (!buffers.compare_exchange_strong(head, buffer->next, std::memory_order_acq_rel))
+    {
+        BinaryLogBuffer* prev = head;
+        while (prev->next != buffer)
+            prev = prev->next;
+        prev->next = buffer->next;
+    }
+    delete buffer;
+}
+
+struct BinaryLogBufferSnapshot
+{
+    BinaryLogBuffer* buffer;
+    unsigned long long int tail;
+    bool retired;
+};
+
+// Write out everything the threads have committed so far, and free retired buffers.
+static void drain()
+{
+    // Read retired before tail, so that the last records of a retired buffer are seen.
+    std::vector<BinaryLogBufferSnapshot> tails;
+    for (BinaryLogBuffer* buffer = buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
+    {
+        BinaryLogBufferSnapshot entry;
+        entry.buffer = buffer;
+        entry.retired = buffer->retired.load(std::memory_order_acquire);
+        entry.tail = buffer->tail.load(std::memory_order_acquire);
+        tails.push_back(entry);
+    }
+
+    // Sites are registered before their first record is committed, so every site used by
+    // the records read above is already known here.
+    {
+        std::lock_guard<std::mutex> lg(registryMtx);
+        for (; numSitesWritten < sites.size(); numSitesWritten++)
+        {
+            const BinaryLogSite* site = sites[numSitesWritten];
+            fputc(BINARY_LOG_SITE, file);
+            writeU32(site->id);
+            writeU32((unsigned int)site->level);
+            writeU32((unsigned int)site->line);
+            writeString(site->file);
+            writeString(site->function);
+            writeString(site->format);
+        }
+    }
+
+    unsigned int curGeneration = generation.load(std::memory_order_relaxed);
+    for (const BinaryLogBufferSnapshot& entry : tails)
+    {
+        BinaryLogBuffer* buffer = entry.buffer;
+        unsigned long long int capacity = buffer->data.size();
+        unsigned long long int pos = buffer->head.load(std::memory_order_relaxed);
+        // Records of a previous run were committed after its final drain, drop them.
+        if (buffer->generation != curGeneration)
+            pos = entry.tail;
+        while (pos < entry.tail)
+        {
+            const char* ptr = &buffer->data[pos % capacity];
+            unsigned int size, siteId;
+            memcpy(&size, ptr, 4);
+            memcpy(&siteId, ptr + 4, 4);
+            if (siteId == BinaryLogBuffer::PADDING_SITE)
+            {
+                pos += size;
+                continue;
+            }
+
+            unsigned int payloadSize = size - BinaryLogBuffer::HEADER_SIZE;
+            fputc(BINARY_LOG_RECORD, file);
+            writeU32(siteId);
+            fwrite(&buffer->threadId, 8, 1, file);
+            fwrite(ptr + 8, 8, 1, file);
+            writeU32(payloadSize);
+            fwrite(ptr + BinaryLogBuffer::HEADER_SIZE, 1, payloadSize, file);
+            pos += (size + 7) & ~7U;
+        }
+        buffer->head.store(pos, std::memory_order_release);
+        if (entry.retired)
+            freeBuffer(buffer);
+    }
+    fflush(file);
+}
+
+static void run(int flushMilliseconds)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stopping)
+    {
+        stopCond.wait_for(lock, std::chrono::milliseconds(flushMilliseconds));
+        drain();
+    }
+}
+
+bool initBinaryLogger(const std::string& path, int bufferSize_, int flushMilliseconds)
+{
+    std::lock_guard<std::mutex> lg(mtx);
+    if (running.load(std::memory_order_relaxed) || file)
+        return false;
+
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    fwrite("BLOG", 1, 4, file);
+    writeU32(1);
+
+    bufferSize = std::max((bufferSize_ + 7) & ~7, 4096);
+    generation.fetch_add(1, std::memory_order_relaxed);
+    numSitesWritten = 0;
+    stopping = false;
+    writer = std::thread(run, flushMilliseconds);
+    running.store(true, std::memory_order_release);
+    return true;
+}
+
+void shutdownBinaryLogger()
+{
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        if (!running.load(std::memory_order_relaxed))
+            return;
+        running.store(false, std::memory_order_release);
+        stopping = true;
+    }
+    stopCond.notify_all();
+    writer.join();
+
+    // Threads which saw running just before it was cleared may still commit a record, live
+    // buffers are only freed once their thread has retired them, so that this stays safe.
+    std::lock_guard<std::mutex> lg(mtx);
+    drain();
+    fclose(file);
+    file = 0;
+}
@@ -0,0 +1,327 @@
+﻿#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <chrono>
+#include <type_traits>
+#include "Log.h"
+
+// Binary logging with deferred formatting.
+// BLOG_* calls do not format anything: they copy the call site id, a timestamp and the raw
+// bytes of their arguments into a ring buffer of the calling thread. A background thread
+// writes the buffers to a compact file, which BinaryLogDecoder renders back as text in the
+// format of the text log, "%m%d %H:%M:%S.%e %L %t file line function: message".
+// Arguments may be integers, floating point values, bool, char, pointers, C strings and
+// std::string. Format strings use the same {} syntax as the LOG_* macros.
+// When the buffer of a thread is full, messages are dropped and counted rather than waiting.
+//
+// File layout, little endian as written by the host:
+//   "BLOG" u32 version
+//   entries, u8 kind followed by
+//     BINARY_LOG_SITE:   u32 id, u32 level, u32 line, then file, function, format as u32 length + bytes
+//     BINARY_LOG_RECORD: u32 site id, u64 thread id, i64 nanoseconds since epoch, u32 size, arguments
+//   every argument is u8 type followed by 8 bytes for integers, double and pointers, 4 bytes
+//   for float, 1 byte for bool and char, or u32 length + bytes for strings
+
+enum BinaryLogEntryKind
+{
+    BINARY_LOG_SITE = 1,
+    BINARY_LOG_RECORD = 2
+};
+
+enum BinaryLogArgType
+{
+    BINARY_LOG_INT64 = 1,
+    BINARY_LOG_UINT64,
+    BINARY_LOG_FLOAT,
+    BINARY_LOG_DOUBLE,
+    BINARY_LOG_BOOL,
+    BINARY_LOG_CHAR,
+    BINARY_LOG_POINTER,
+    BINARY_LOG_STRING
+};
+
+// Call site of a BLOG_* macro, registered once on its first enabled call.
+struct BinaryLogSite
+{
+    BinaryLogSite(const char* file_, int line_, const char* function_, spdlog::level::level_enum level_, const char* format_);
+
+    const char* file;
+    int line;
+    const char* function;
+    spdlog::level::level_enum level;
+    const char* format;
+    unsigned int id;
+};
+
+// Single producer single consumer byte ring of one thread. Positions only grow, records
+// are 8 byte aligned and never wrap around the end of the buffer, the unused end is
+// skipped by a padding record. A record starts with u32 size without alignment, u32 site id
+// and i64 timestamp, a padding record only has u32 size and PADDING_SITE.
+// A buffer is retired by its thread when the thread exits, or when it moves to a new buffer
+// after the logger was restarted, the writer then frees it.
+struct BinaryLogBuffer
+{
+    enum
+    {
+        HEADER_SIZE = 16,
+        PADDING_SITE = 0xffffffffu
+    };
+
+    std::vector<char> data;
+    std::atomic<unsigned long long int> head, tail;
+    std::atomic<bool> retired;
+    unsigned long long int threadId;
+    unsigned int generation;
+    BinaryLogBuffer* next;
+
+    // Return where to write payloadSize bytes of arguments, or 0 if the buffer is full.
+    char* reserve(unsigned int siteId, unsigned int payloadSize, unsigned long long int& newTail)
+    {
+        unsigned long long int capacity = data.size();
+        unsigned long long int recordSize = (HEADER_SIZE + payloadSize + 7) & ~7ULL;
+        unsigned long long int curTail = tail.load(std::memory_order_relaxed);
+        unsigned long long int pos = curTail % capacity;
+        unsigned long long int padding = pos + recordSize > capacity ? capacity - pos : 0;
+        if (recordSize + padding > capacity - (curTail - head.load(std::memory_order_acquire)))
+            return 0;
+
+        if (padding)
+        {
+            unsigned int paddingSize = (unsigned int)padding, paddingSite = PADDING_SITE;
+            memcpy(&data[pos], &paddingSize, 4);
+            memcpy(&data[pos + 4], &paddingSite, 4);
+            pos = 0;
+        }
+        unsigned int size = HEADER_SIZE + payloadSize;
+        long long int stamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        memcpy(&data[pos], &size, 4);
+        memcpy(&data[pos + 4], &siteId, 4);
+        memcpy(&data[pos + 8], &stamp, 8);
+        newTail = curTail + padding + recordSize;
+        return &data[pos + HEADER_SIZE];
+    }
+
+    void commit(unsigned long long int newTail)
+    {
+        tail.store(newTail, std::memory_order_release);
+    }
+};
+
+// Start the writer thread, logging to path. Each thread gets a buffer of bufferSize bytes,
+// which is written out every flushMilliseconds. Return false if path can not be opened.
+// The logger may be started again after shutdownBinaryLogger, threads then move to a new
+// buffer on their next message, and records left in their old buffer are discarded.
+bool initBinaryLogger(const std::string& path, int bufferSize = 1 << 20, int flushMilliseconds = 100);
+
+// Write out what remains in the buffers and stop the writer thread.
+// Called automatically at normal process exit, after main returns or on exit(), if the
+// program did not call it before.
+void shutdownBinaryLogger();
+
+// Number of messages dropped because the buffer of their thread was full.
+unsigned long long int numDroppedBinaryLogs();
+
+// Minimum level of BLOG_* messages at runtime, trace by default.
+extern std::atomic<int> binaryLogLevel;
+
+inline bool binaryLogEnabled(spdlog::level::level_enum level)
+{
+    return (int)level >= binaryLogLevel.load(std::memory_order_relaxed);
+}
+
+// Buffer of the calling thread, 0 if the binary logger is not running.
+BinaryLogBuffer* binaryLogLocalBuffer();
+
+void countDroppedBinaryLog();
+
+template<typename Type, typename Enable = void>
+struct BinaryLogArg;
+
+template<typename Type>
+struct BinaryLogArg<Type, typename std::enable_if<std::is_integral<Type>::value &&
+    !std::is_same<Type, bool>::value && !std::is_same<Type, char>::value>::type>
+{
+    static unsigned int size(Type)
+    {
+        return 9;
+    }
+
+    static char* write(char* ptr, Type val)
+    {
+        *ptr = std::is_signed<Type>::value ? BINARY_LOG_INT64 : BINARY_LOG_UINT64;
+        if (std::is_signed<Type>::value)
+        {
+            long long int ext = (long long int)val;
+            memcpy(ptr + 1, &ext, 8);
+        }
+        else
+        {
+            unsigned long long int ext = (unsigned long long int)val;
+            memcpy(ptr + 1, &ext, 8);
+        }
+        return ptr + 9;
+    }
+};
+
+template<typename Type, int Tag>
+struct BinaryLogPlainArg
+{
+    static unsigned int size(Type)
+    {
+        return 1 + sizeof(Type);
+    }
+
+    static char* write(char* ptr, Type val)
+    {
+        *ptr = (char)Tag;
+        memcpy(ptr + 1, &val, sizeof(Type));
+        return ptr + 1 + sizeof(Type);
+    }
+};
+
+template<>
+struct BinaryLogArg<float> : BinaryLogPlainArg<float, BINARY_LOG_FLOAT> {};
+
+template<>
+struct BinaryLogArg<double> : BinaryLogPlainArg<double, BINARY_LOG_DOUBLE> {};
+
+template<>
+struct BinaryLogArg<char> : BinaryLogPlainArg<char, BINARY_LOG_CHAR> {};
+
+template<>
+struct BinaryLogArg<bool>
+{
+    static unsigned int size(bool)
+    {
+        return 2;
+    }
+
+    static char* write(char* ptr, bool val)
+    {
+        ptr[0] = BINARY_LOG_BOOL;
+        ptr[1] = val ? 1 : 0;
+        return ptr + 2;
+    }
+};
+
+struct BinaryLogStringArg
+{
+    static unsigned int size(unsigned int len)
+    {
+        return 5 + len;
+    }
+
+    static char* write(char* ptr, const char* str, unsigned int len)
+    {
+        *ptr = BINARY_LOG_STRING;
+        memcpy(ptr + 1, &len, 4);
+        memcpy(ptr + 5, str, len);
+        return ptr + 5 + len;
+    }
+};
+
+template<>
+struct BinaryLogArg<const char*>
+{
+    static unsigned int size(const char* str)
+    {
+        return BinaryLogStringArg::size(str ? (unsigned int)strlen(str) : 0);
+    }
+
+    static char* write(char* ptr, const char* str)
+    {
+        return BinaryLogStringArg::write(ptr, str, str ? (unsigned int)strlen(str) : 0);
+    }
+};
+
+template<>
+struct BinaryLogArg<char*> : BinaryLogArg<const char*> {};
+
+template<>
+struct BinaryLogArg<std::string>
+{
+    static unsigned int size(const std::string& str)
+    {
+        return BinaryLogStringArg::size((unsigned int)str.size());
+    }
+
+    static char* write(char* ptr, const std::string& str)
+    {
+        return BinaryLogStringArg::write(ptr, str.data(), (unsigned int)str.size());
+    }
+};
+
+template<typename Type>
+struct BinaryLogArg<Type*, typename std::enable_if<!std::is_same<typename std::remove_cv<Type>::type, char>::value>::type>
+{
+    static unsigned int size(const Type*)
+    {
+        return 9;
+    }
+
+    static char* write(char* ptr, const Type* val)
+    {
+        *ptr = BINARY_LOG_POINTER;
+        unsigned long long int ext = (unsigned long long int)(size_t)val;
+        memcpy(ptr + 1, &ext, 8);
+        return ptr + 9;
+    }
+};
+
+inline unsigned int binaryLogArgsSize()
+{
+    return 0;
+}
+
+template<typename Type, typename... Args>
+unsigned int binaryLogArgsSize(const Type& val, const Args&... args)
+{
+    return BinaryLogArg<typename std::decay<Type>::type>::size(val) + binaryLogArgsSize(args...);
+}
+
+inline char* binaryLogWriteArgs(char* ptr)
+{
+    return ptr;
+}
+
+template<typename Type, typename... Args>
+char* binaryLogWriteArgs(char* ptr, const Type& val, const Args&... args)
+{
+    ptr = BinaryLogArg<typename std::decay<Type>::type>::write(ptr, val);
+    return binaryLogWriteArgs(ptr, args...);
+}
+
+template<typename... Args>
+void binaryLog(const BinaryLogSite& site, const Args&... args)
+{
+    BinaryLogBuffer* buffer = binaryLogLocalBuffer();
+    if (!buffer)
+        return;
+
+    unsigned long long int newTail;
+    char* ptr = buffer->reserve(site.id, binaryLogArgsSize(args...), newTail);
+    if (!ptr)
+    {
+        countDroppedBinaryLog();
+        return;
+    }
+    binaryLogWriteArgs(ptr, args...);
+    buffer->commit(newTail);
+}
+
+#define BLOG_AT_LEVEL(lvl, enabled, msg, ...) \
+    do { if ((enabled) && binaryLogEnabled(lvl)) { \
+        static const BinaryLogSite binaryLogSite(LOG_BASE_NAME(__FILE__), __LINE__, __FUNCTION_NAME__, lvl, msg); \
+        binaryLog(binaryLogSite, ##__VA_ARGS__); } } while (0)
+
+#define BLOG_TRACE(msg, ...) BLOG_AT_LEVEL(spdlog::level::trace, LOG_ACTIVE_LEVEL <= LOG_LEVEL_TRACE, msg, ##__VA_ARGS__)
+#define BLOG_DEBUG(msg, ...) BLOG_AT_LEVEL(spdlog::level::debug, LOG_ACTIVE_LEVEL <= LOG_LEVEL_DEBUG, msg, ##__VA_ARGS__)
+#define BLOG_INFO(msg, ...) BLOG_AT_LEVEL(spdlog::level::info, LOG_ACTIVE_LEVEL <= LOG_LEVEL_INFO, msg, ##__VA_ARGS__)
+#define BLOG_WARNING(msg, ...) BLOG_AT_LEVEL(spdlog::level::warn, LOG_ACTIVE_LEVEL <= LOG_LEVEL_WARNING, msg, ##__VA_ARGS__)
+#define BLOG_ERROR(msg, ...) BLOG_AT_LEVEL(spdlog::level::err, LOG_ACTIVE_LEVEL <= LOG_LEVEL_ERROR, msg, ##__VA_ARGS__)
+#define BLOG_CRITICAL(msg, ...) BLOG_AT_LEVEL(spdlog::level::critical, LOG_ACTIVE_LEVEL <= LOG_LEVEL_CRITICAL, msg, ##__VA_ARGS__)
+#define BLOG_FATAL(msg, ...) BLOG_AT_LEVEL(spdlog::level::critical, LOG_ACTIVE_LEVEL <= LOG_LEVEL_CRITICAL, msg, ##__VA_ARGS__)
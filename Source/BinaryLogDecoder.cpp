@@ -0,0 +1,267 @@
+﻿// Render a file written by the binary logger, see BinaryLog.h, as text in the format of
+// the text log, sorted by time:
+//   BinaryLogDecoder input [output]
+// Only the spdlog headers and fmt are needed, e.g. with an external fmt
+//   g++ -std=c++11 -O2 -DSPDLOG_FMT_EXTERNAL BinaryLogDecoder.cpp -lfmt
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#ifdef SPDLOG_FMT_EXTERNAL
+#include <fmt/format.h>
+#include <fmt/args.h>
+#else
+#include "spdlog/fmt/bundled/format.h"
+#include "spdlog/fmt/bundled/args.h"
+#endif
+
+#include "BinaryLog.h"
+
+struct SiteInfo
+{
+    unsigned int level;
+    unsigned int line;
+    std::string file, function, format;
+};
+
+struct RecordInfo
+{
+    unsigned int siteId;
+    unsigned long long int threadId;
+    long long int stamp;
+    const char* args;
+    unsigned int size;
+};
+
+class Reader
+{
+public:
+    Reader(const std::vector<char>& data_) : data(data_), pos(0) {}
+
+    bool atEnd() const
+    {
+        return pos >= data.size();
+    }
+
+    template<typename Type>
+    bool read(Type& val)
+    {
+        if (pos + sizeof(Type) > data.size())
+            return false;
+        memcpy(&val, &data[pos], sizeof(Type));
+        pos += sizeof(Type);
+        return true;
+    }
+
+    bool readString(std::string& str)
+    {
+        unsigned int len;
+        if (!read(len) || pos + len > data.size())
+            return false;
+        str.assign(&data[pos], len);
+        pos += len;
+        return true;
+    }
+
+    const char* skip(size_t len)
+    {
+        if (pos + len > data.size())
+            return 0;
+        const char* ptr = &data[pos];
+        pos += len;
+        return ptr;
+    }
+
+private:
+    const std::vector<char>& data;
+    size_t pos;
+};
+
+// Return false if the arguments are malformed, e.g. in a corrupted file, in which case
+// nothing is read past ptr + size.
+static bool formatArgs(const SiteInfo& site, const char* ptr, unsigned int size, std::string& msg)
+{
+    fmt::dynamic_format_arg_store<fmt::format_context> store;
+    const char* end = ptr + size;
+    while (ptr < end)
+    {
+        char type = *ptr++;
+        size_t left = end - ptr;
+        if (type == BINARY_LOG_STRING)
+        {
+            unsigned int len;
+            if (left < 4)
+                return false;
+            memcpy(&len, ptr, 4);
+            if (len > left - 4)
+                return false;
+            store.push_back(std::string(ptr + 4, len));
+            ptr += 4 + len;
+            continue;
+        }
+        if (type == BINARY_LOG_FLOAT)
+        {
+            float val;
+            if (left < 4)
+                return false;
+            memcpy(&val, ptr, 4);
+            store.push_back(val);
+            ptr += 4;
+            continue;
+        }
+        if (type == BINARY_LOG_BOOL || type == BINARY_LOG_CHAR)
+        {
+            if (left < 1)
+                return false;
+            if (type == BINARY_LOG_BOOL)
+                store.push_back(*ptr != 0);
+            else
+                store.push_back(*ptr);
+            ptr += 1;
+            continue;
+        }
+
+        if (left < 8)
+            return false;
+        long long int ival;
+        unsigned long long int uval;
+        double dval;
+        switch (type)
+        {
+        case BINARY_LOG_INT64:
+            memcpy(&ival, ptr, 8);
+            store.push_back(ival);
+            break;
+        case BINARY_LOG_UINT64:
+            memcpy(&uval, ptr, 8);
+            store.push_back(uval);
+            break;
+        case BINARY_LOG_DOUBLE:
+            memcpy(&dval, ptr, 8);
+            store.push_back(dval);
+            break;
+        case BINARY_LOG_POINTER:
+            memcpy(&uval, ptr, 8);
+            store.push_back((const void*)(size_t)uval);
+            break;
+        default:
+            return false;
+        }
+        ptr += 8;
+    }
+
+    try
+    {
+        msg = fmt::vformat(site.format, store);
+    }
+    catch (const fmt::format_error& e)
+    {
+        msg = site.format + " [format error: " + e.what() + "]";
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s input [output]\n", argv[0]);
+        return 1;
+    }
+
+    std::ifstream ifs(argv[1], std::ios::binary);
+    if (!ifs)
+    {
+        fprintf(stderr, "can not open %s\n", argv[1]);
+        return 1;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+    Reader reader(data);
+    const char* magic = reader.skip(4);
+    unsigned int version;
+    if (!magic || memcmp(magic, "BLOG", 4) != 0 || !reader.read(version) || version != 1)
+    {
+        fprintf(stderr, "%s is not a binary log\n", argv[1]);
+        return 1;
+    }
+
+    std::map<unsigned int, SiteInfo> sites;
+    std::vector<RecordInfo> records;
+    while (!reader.atEnd())
+    {
+        unsigned char kind = 0;
+        reader.read(kind);
+        bool ok = false;
+        if (kind == BINARY_LOG_SITE)
+        {
+            unsigned int id;
+            SiteInfo site;
+            ok = reader.read(id) && reader.read(site.level) && reader.read(site.line) &&
+                reader.readString(site.file) && reader.readString(site.function) && reader.readString(site.format);
+            if (ok)
+                sites[id] = site;
+        }
+        else if (kind == BINARY_LOG_RECORD)
+        {
+            RecordInfo record;
+            ok = reader.read(record.siteId) && reader.read(record.threadId) && reader.read(record.stamp) &&
+                reader.read(record.size) && (record.args = reader.skip(record.size)) != 0;
+            if (ok)
+                records.push_back(record);
+        }
+        // A file cut by a crash ends with a partial entry, keep what was read before it.
+        if (!ok)
+        {
+            fprintf(stderr, "truncated or corrupted entry, stop reading\n");
+            break;
+        }
+    }
+
+    std::stable_sort(records.begin(), records.end(),
+        [](const RecordInfo& lhs, const RecordInfo& rhs) { return lhs.stamp < rhs.stamp; });
+
+    FILE* out = argc > 2 ? fopen(argv[2], "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "can not open %s\n", argv[2]);
+        return 1;
+    }
+
+    static const char* levelNames[] = { "T", "D", "I", "W", "E", "C", "O" };
+    std::string msg;
+    for (const RecordInfo& record : records)
+    {
+        std::map<unsigned int, SiteInfo>::const_iterator itr = sites.find(record.siteId);
+        if (itr == sites.end())
+            continue;
+        const SiteInfo& site = itr->second;
+        if (!formatArgs(site, record.args, record.size, msg))
+            msg = site.format + " [bad arguments]";
+
+        time_t seconds = (time_t)(record.stamp / 1000000000LL);
+        int millis = (int)(record.stamp / 1000000LL % 1000);
+        struct tm tmVal;
+#ifdef _WIN32
+        localtime_s(&tmVal, &seconds);
+#else
+        localtime_r(&seconds, &tmVal);
+#endif
+        char timeBuf[32];
+        strftime(timeBuf, sizeof(timeBuf), "%m%d %H:%M:%S", &tmVal);
+        fprintf(out, "%s.%03d %s %llu %s %u %s: %s\n", timeBuf, millis,
+            site.level < 7 ? levelNames[site.level] : "?", record.threadId,
+            site.file.c_str(), site.line, site.function.c_str(), msg.c_str());
+    }
+
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
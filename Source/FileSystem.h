@@ -20,14 +20,35 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#endif
 
 #ifdef _WIN32
 //#include "WinDirent.h"
 #else
 #include <dirent.h>
+#include <fcntl.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 #endif
 
 #ifndef _WIN32
@@ -51,26 +72,24 @@ inline int createDirectory(const std::string& dir)
     if (dir.empty())
         return 0;
 
-    int length = (int)dir.length() + 1;
-    std::vector<char> buf(length, 0);
-    memcpy(buf.data(), dir.data(), length - 1);
-    char* local = buf.data();
+    std::string local(dir);
+    size_t length = local.size();
 
     // Create intermediate directories.
     // IMPORTANT NOTICE!!!
     // The first slash or backslash should not be changed to '\0'
     // in Linux system
-    for (int i = 1; i < length; i++)
+    for (size_t i = 1; i < length; i++)
     {
         if (local[i] == '\\' || local[i] == '/')
         {
             local[i] = '\0';
 
             // If the directory does not exist, create it.
-            int ret = ACCESS(local, 0);
+            int ret = ACCESS(local.c_str(), 0);
             if (ret != 0)
             {
-                ret = MKDIR(local);
+                ret = MKDIR(local.c_str());
                 if (ret != 0)
                 {
                     return -1;
@@ -81,43 +100,139 @@ inline int createDirectory(const std::string& dir)
         }
     }
 
-    return MKDIR(local);
+    return MKDIR(local.c_str());
 }
 
-inline bool isDirectory(const std::string& path)
+enum FileType
 {
+    FILE_TYPE_NONE,      // the file could not be queried, see FileInfo::error
+    FILE_TYPE_REGULAR,
+    FILE_TYPE_DIRECTORY,
+    FILE_TYPE_SYMLINK,   // only when links are not followed
+    FILE_TYPE_OTHER
+};
+
+// Everything a single stat tells about a file.
+struct FileInfo
+{
+    FileInfo() : type(FILE_TYPE_NONE), size(0), mtime(0), inode(0), error(0) {}
+
+    FileType type;
+    long long int size;
+    // Last modification time, in seconds since the epoch.
+    long long int mtime;
+    // Always 0 on Windows.
+    unsigned long long int inode;
+    // errno of the failed call, 0 on success.
+    int error;
+};
+
 #ifdef _WIN32
-    struct _stat64 info;
-    _stat64(path.c_str(), &info);
+inline void fillFileInfo(const struct _stat64& st, FileInfo& info)
 #else
-    struct stat info;
-    stat(path.c_str(), &info);
+inline void fillFileInfo(const struct stat& st, FileInfo& info)
+#endif
+{
+    if ((st.st_mode & S_IFMT) == S_IFREG)
+        info.type = FILE_TYPE_REGULAR;
+    else if ((st.st_mode & S_IFMT) == S_IFDIR)
+        info.type = FILE_TYPE_DIRECTORY;
+#ifndef _WIN32
+    else if (S_ISLNK(st.st_mode))
+        info.type = FILE_TYPE_SYMLINK;
 #endif
-    return (info.st_mode & S_IFDIR) != 0;
+    else
+        info.type = FILE_TYPE_OTHER;
+    info.size = (long long int)st.st_size;
+    info.mtime = (long long int)st.st_mtime;
+    info.inode = (unsigned long long int)st.st_ino;
+    info.error = 0;
 }
 
-inline bool isRegularFile(const std::string& path)
+// Query path with one stat, or lstat if followLinks is false.
+// Return false on failure, with info.type FILE_TYPE_NONE and info.error set.
+inline bool getFileInfo(const std::string& path, FileInfo& info, bool followLinks = true)
 {
+    info = FileInfo();
 #ifdef _WIN32
-    struct _stat64 info;
-    _stat64(path.c_str(), &info);
+    (void)followLinks;
+    struct _stat64 st;
+    int ret = _stat64(path.c_str(), &st);
 #else
-    struct stat info;
-    stat(path.c_str(), &info);
+    struct stat st;
+    int ret = followLinks ? stat(path.c_str(), &st) : lstat(path.c_str(), &st);
 #endif
-    return (info.st_mode & S_IFREG) != 0;
+    if (ret != 0)
+    {
+        info.error = errno;
+        return false;
+    }
+    fillFileInfo(st, info);
+    return true;
 }
 
+// Cache of FileInfo by path, for the duration of one scan, so that repeated queries of the
+// same path cost nothing. Failed queries are cached as well.
+// Not thread safe, use one cache per thread or per scan.
+class FileInfoCache
+{
+public:
+    FileInfoCache(bool followLinks_ = true) : followLinks(followLinks_) {}
+
+    // Cached info of path, queried on the first call. Return false if the query failed.
+    bool get(const std::string& path, FileInfo& info)
+    {
+        std::unordered_map<std::string, FileInfo>::const_iterator itr = infos.find(path);
+        if (itr == infos.end())
+        {
+            getFileInfo(path, info, followLinks);
+            infos.insert(std::make_pair(path, info));
+        }
+        else
+            info = itr->second;
+        return info.type != FILE_TYPE_NONE;
+    }
+
+    // Record info obtained otherwise, e.g. from DirectoryReader::getInfo during a traversal.
+    void put(const std::string& path, const FileInfo& info)
+    {
+        infos[path] = info;
+    }
+
+    void clear()
+    {
+        infos.clear();
+    }
+
+    size_t size() const
+    {
+        return infos.size();
+    }
+
+private:
+    bool followLinks;
+    std::unordered_map<std::string, FileInfo> infos;
+};
+
+// False if path does not exist or can not be queried.
+inline bool isDirectory(const std::string& path)
+{
+    FileInfo info;
+    return getFileInfo(path, info) && info.type == FILE_TYPE_DIRECTORY;
+}
+
+// False if path does not exist or can not be queried.
+inline bool isRegularFile(const std::string& path)
+{
+    FileInfo info;
+    return getFileInfo(path, info) && info.type == FILE_TYPE_REGULAR;
+}
+
+// -1 if path does not exist or can not be queried.
 inline long long int fileSize(const std::string& path)
 {
-#ifdef _WIN32
-    struct _stat64 info;
-    _stat64(path.c_str(), &info);
-#else
-    struct stat info;
-    stat(path.c_str(), &info);
-#endif
-    return info.st_size;
+    FileInfo info;
+    return getFileInfo(path, info) ? info.size : -1;
 }
 
 inline bool isImage(const std::string& path)
@@ -144,126 +259,304 @@ inline bool endsWithSlash(const std::string& path)
     return (path.back() == '\\') || (path.back() == '/');
 }
 
-inline void readDirectory(const std::string& directoryName, std::vector<std::string>& fileNames, bool addDirectoryName = false)
+// Lazy listing of a directory, one entry at a time, without "." and "..".
+// The name and the path of the current entry live in buffers reused from entry to entry,
+// so memory stays constant whatever the size of the directory, and they are only valid
+// until the next call to next().
+//     DirectoryReader reader(dir);
+//     while (reader.next())
+//         use(reader.name(), reader.path());
+// On Linux entries are read with getdents64 in 64 KB batches. On POSIX systems, statEntry
+// and openEntry work relative to the open directory, so the kernel does not resolve the
+// whole path again, and isDirectory only needs a stat when the entry type is unknown.
+class DirectoryReader
 {
-    fileNames.clear();
+public:
+    explicit DirectoryReader(const std::string& directoryName)
+    {
+        rootLength = directoryName.size();
+        if (endsWithSlash(directoryName))
+            rootLength--;
+        currPath.assign(directoryName, 0, rootLength);
+#ifdef _WIN32
+        currPath += "\\";
+        std::string pattern = currPath + "*.*";
+        handle = directoryName.empty() ? static_cast<intptr_t>(-1) : _findfirst(pattern.c_str(), &fileInfo);
+        pendingFirst = handle != static_cast<intptr_t>(-1);
+        lastError = pendingFirst ? 0 : (directoryName.empty() ? ENOENT : errno);
+#elif defined(__linux__)
+        currPath += "/";
+        dirFd = directoryName.empty() ? -1 : open(currPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        lastError = dirFd >= 0 ? 0 : (directoryName.empty() ? ENOENT : errno);
+        if (dirFd >= 0)
+            buf.reset(new char[BUFFER_SIZE]);
+        bufPos = bufEnd = 0;
+#else
+        currPath += "/";
+        dir = directoryName.empty() ? NULL : opendir(currPath.c_str());
+        lastError = dir != NULL ? 0 : (directoryName.empty() ? ENOENT : errno);
+#endif
+        rootLength = currPath.size();
+        currName = 0;
+        currNameLength = 0;
+        currType = 0;
+    }
 
-    const std::string* rootDir;
-    std::string dirName;
-    if (endsWithSlash(directoryName))
+    ~DirectoryReader()
     {
-        dirName = directoryName.substr(0, directoryName.size() - 1);
-        rootDir = &dirName;
+#ifdef _WIN32
+        if (handle != static_cast<intptr_t>(-1))
+            _findclose(handle);
+#elif defined(__linux__)
+        if (dirFd >= 0)
+            close(dirFd);
+#else
+        if (dir != NULL)
+            closedir(dir);
+#endif
     }
-    else
-        rootDir = &directoryName;
 
+    // False if the directory could not be opened.
+    bool isOpen() const
+    {
 #ifdef _WIN32
-    struct _finddata_t fileInfo;
-    std::string str = *rootDir + "\\*.*";
-    intptr_t fileHandle = _findfirst(str.c_str(), &fileInfo);
-    if (fileHandle != static_cast<intptr_t>(-1))
+        return handle != static_cast<intptr_t>(-1);
+#elif defined(__linux__)
+        return dirFd >= 0;
+#else
+        return dir != NULL;
+#endif
+    }
+
+    // errno of the failure to open or read the directory, 0 if there was none.
+    // When next() returns false with an error, the listing is incomplete.
+    int error() const
+    {
+        return lastError;
+    }
+
+    // Move to the next entry, return false when there is none left or on error.
+    bool next()
     {
-        do
+        while (true)
         {
-            if (strcmp(fileInfo.name, ".") == 0 ||
-                strcmp(fileInfo.name, "..") == 0)
+#ifdef _WIN32
+            if (handle == static_cast<intptr_t>(-1))
+                return false;
+            if (pendingFirst)
+                pendingFirst = false;
+            else if (_findnext(handle, &fileInfo) != 0)
+            {
+                if (errno != ENOENT)
+                    lastError = errno;
+                return false;
+            }
+            const char* name = fileInfo.name;
+#elif defined(__linux__)
+            if (dirFd < 0)
+                return false;
+            if (bufPos >= bufEnd)
+            {
+                long len = syscall(SYS_getdents64, dirFd, buf.get(), BUFFER_SIZE);
+                if (len < 0)
+                    lastError = errno;
+                if (len <= 0)
+                    return false;
+                bufPos = 0;
+                bufEnd = (size_t)len;
+            }
+            // struct linux_dirent64: u64 d_ino, s64 d_off, u16 d_reclen, u8 d_type, char d_name[]
+            const char* ent = buf.get() + bufPos;
+            unsigned short recordLength;
+            memcpy(&recordLength, ent + 16, sizeof(recordLength));
+            bufPos += recordLength;
+            currType = (unsigned char)ent[18];
+            const char* name = ent + 19;
+#else
+            if (dir == NULL)
+                return false;
+            errno = 0;
+            struct dirent* ent = readdir(dir);
+            if (ent == NULL)
+            {
+                lastError = errno;
+                return false;
+            }
+            currType = ent->d_type;
+            const char* name = ent->d_name;
+#endif
+            if (strcmp(name, ".") == 0 ||
+                strcmp(name, "..") == 0)
                 continue;
 
-            if (addDirectoryName)
-                fileNames.push_back(*rootDir + "\\" + fileInfo.name);
-            else
-                fileNames.push_back((std::string)fileInfo.name);
-        } while (_findnext(fileHandle, &fileInfo) == 0);
+            currNameLength = strlen(name);
+            currPath.resize(rootLength);
+            currPath.append(name, currNameLength);
+            currName = currPath.c_str() + rootLength;
+            return true;
+        }
+    }
+
+    const char* name() const
+    {
+        return currName;
     }
-    _findclose(fileHandle);
-    //std::sort(fileNames.begin(), fileNames.end());
+
+    size_t nameLength() const
+    {
+        return currNameLength;
+    }
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+    std::string_view nameView() const
+    {
+        return std::string_view(currName, currNameLength);
+    }
+#endif
+
+    // Directory name, separator and entry name.
+    const std::string& path() const
+    {
+        return currPath;
+    }
+
+    // Whether the current entry is a directory, following symbolic links like isDirectory.
+    bool isDirectory() const
+    {
+#ifdef _WIN32
+        return (fileInfo.attrib & _A_SUBDIR) != 0;
 #else
-    DIR *dir;
-    struct dirent *ent;
-    dir = opendir(rootDir->c_str());
-    if (dir != NULL)
+        if (currType == DT_DIR)
+            return true;
+        if (currType != DT_UNKNOWN && currType != DT_LNK)
+            return false;
+        struct stat info;
+        return statEntry(info) && S_ISDIR(info.st_mode);
+#endif
+    }
+
+#ifndef _WIN32
+    // Entry type from the directory listing, DT_UNKNOWN if the file system does not tell.
+    unsigned char type() const
     {
-        while ((ent = readdir(dir)) != NULL)
-        {
-            if (strcmp(ent->d_name, ".") == 0 ||
-                strcmp(ent->d_name, "..") == 0)
-                continue;
+        return currType;
+    }
 
-            if (addDirectoryName)
-                fileNames.push_back(*rootDir + "/" + ent->d_name);
-            else
-                fileNames.push_back(std::string(ent->d_name));
+    // Descriptor of the open directory, for other *at calls.
+    int fd() const
+    {
+#ifdef __linux__
+        return dirFd;
+#else
+        return dir != NULL ? dirfd(dir) : -1;
+#endif
+    }
+
+    // fstatat of the current entry, return false on failure.
+    bool statEntry(struct stat& info, bool followLinks = true) const
+    {
+        return fstatat(fd(), currName, &info, followLinks ? 0 : AT_SYMLINK_NOFOLLOW) == 0;
+    }
+
+    // FileInfo of the current entry, with fstatat. Return false on failure.
+    bool getInfo(FileInfo& info, bool followLinks = true) const
+    {
+        info = FileInfo();
+        struct stat st;
+        if (!statEntry(st, followLinks))
+        {
+            info.error = errno;
+            return false;
         }
+        fillFileInfo(st, info);
+        return true;
+    }
+
+    // openat of the current entry, return the descriptor or -1.
+    int openEntry(int flags, mode_t mode = 0) const
+    {
+        return openat(fd(), currName, flags | O_CLOEXEC, mode);
     }
-    closedir(dir);
 #endif
+
+private:
+    DirectoryReader(const DirectoryReader&);
+    DirectoryReader& operator=(const DirectoryReader&);
+
+#ifdef _WIN32
+    struct _finddata_t fileInfo;
+    intptr_t handle;
+    bool pendingFirst;
+#elif defined(__linux__)
+    enum
+    {
+        BUFFER_SIZE = 64 * 1024
+    };
+
+    int dirFd;
+    size_t bufPos, bufEnd;
+    // Batch of getdents64 records, on the heap since readers are often nested on the stack.
+    // operator new aligns it enough for the 8-byte aligned records.
+    std::unique_ptr<char[]> buf;
+#else
+    DIR* dir;
+#endif
+    int lastError;
+    std::string currPath;
+    size_t rootLength;
+    const char* currName;
+    size_t currNameLength;
+    unsigned char currType;
+};
+
+// Call func(reader) for every entry of a directory, where reader is the DirectoryReader
+// positioned on the entry, until func returns false.
+// Return false if the directory could not be opened or read to the end.
+template<typename Func>
+inline bool forEachDirectoryEntry(const std::string& directoryName, Func func)
+{
+    DirectoryReader reader(directoryName);
+    if (!reader.isOpen())
+        return false;
+    while (reader.next())
+    {
+        if (!func(reader))
+            return true;
+    }
+    return reader.error() == 0;
 }
 
-template<typename Pred>
-inline void readDirectory(const std::string& directoryName, std::vector<std::string>& fileNames,
-    Pred func, bool addDirectoryName = false)
+inline void readDirectory(const std::string& directoryName, std::vector<std::string>& fileNames, bool addDirectoryName = false)
 {
     fileNames.clear();
 
-    const std::string* rootDir;
-    std::string dirName;
-    if (endsWithSlash(directoryName))
+    DirectoryReader reader(directoryName);
+    while (reader.next())
     {
-        dirName = directoryName.substr(0, directoryName.size() - 1);
-        rootDir = &dirName;
+        if (addDirectoryName)
+            fileNames.push_back(reader.path());
+        else
+            fileNames.push_back(std::string(reader.name(), reader.nameLength()));
     }
-    else
-        rootDir = &directoryName;
+}
 
-#ifdef _WIN32
-    struct _finddata_t fileInfo;
-    std::string str = *rootDir + "\\*.*";
-    intptr_t fileHandle = _findfirst(str.c_str(), &fileInfo);
-    if (fileHandle != static_cast<intptr_t>(-1))
-    {
-        do
-        {
-            if (strcmp(fileInfo.name, ".") == 0 ||
-                strcmp(fileInfo.name, "..") == 0)
-                continue;
+template<typename Pred>
+inline void readDirectory(const std::string& directoryName, std::vector<std::string>& fileNames,
+    Pred func, bool addDirectoryName = false)
+{
+    fileNames.clear();
 
-            std::string currName = *rootDir + "\\" + fileInfo.name;
-            if (func(currName))
-            {
-                if (addDirectoryName)
-                    fileNames.push_back(currName);
-                else
-                    fileNames.push_back((std::string)fileInfo.name);
-            }
-        } while (_findnext(fileHandle, &fileInfo) == 0);
-    }
-    _findclose(fileHandle);
-    //std::sort(fileNames.begin(), fileNames.end());
-#else
-    DIR *dir;
-    struct dirent *ent;
-    dir = opendir(rootDir->c_str());
-    if (dir != NULL)
+    DirectoryReader reader(directoryName);
+    while (reader.next())
     {
-        while ((ent = readdir(dir)) != NULL)
+        if (func(reader.path()))
         {
-            if (strcmp(ent->d_name, ".") == 0 ||
-                strcmp(ent->d_name, "..") == 0)
-                continue;
-
-            std::string currName = *rootDir + "/" + ent->d_name;
-            if (func(currName))
-            {
-                if (addDirectoryName)
-                    fileNames.push_back(*rootDir + "/" + ent->d_name);
-                else
-                    fileNames.push_back(std::string(ent->d_name));
-            }
+            if (addDirectoryName)
+                fileNames.push_back(reader.path());
+            else
+                fileNames.push_back(std::string(reader.name(), reader.nameLength()));
         }
     }
-    closedir(dir);
-#endif
 }
 
 template<typename Pred>
@@ -282,19 +575,135 @@ inline void collectFilesRecursively(const std::string& directoryName, std::vecto
         std::string dir = stack.back();
         stack.pop_back();
         
-        std::vector<std::string> results;
-        readDirectory(dir, results, true);
-        int numResults = results.size();
-        for (int i = 0; i < numResults; i++)
+        DirectoryReader reader(dir);
+        while (reader.next())
         {
-            if (isDirectory(results[i]))
-                stack.push_back(results[i]);
-            if (func(results[i]))
-                fileNames.push_back(results[i]);
+            if (reader.isDirectory())
+                stack.push_back(reader.path());
+            if (func(reader.path()))
+                fileNames.push_back(reader.path());
         }
     }
 }
 
+// Same result as collectFilesRecursively as a set, in no particular order, collected by
+// numThreads threads, all hardware threads by default. func is called concurrently and
+// must be thread safe.
+// Every worker keeps a stack of directories to visit and steals from the bottom of the
+// stacks of the others when its own is empty, and sleeps until a directory is pushed when
+// there is nothing to steal. Entry types come from the directory listing, see
+// DirectoryReader::isDirectory.
+template<typename Pred>
+inline void collectFilesRecursivelyParallel(const std::string& directoryName, std::vector<std::string>& fileNames,
+    Pred func, int numThreads = 0)
+{
+    fileNames.clear();
+
+    if (!isDirectory(directoryName))
+        return;
+
+    if (numThreads <= 0)
+        numThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+
+    struct Worker
+    {
+        std::mutex mtx;
+        std::deque<std::string> dirs;
+        std::vector<std::string> results;
+    };
+    std::vector<Worker> workers(numThreads);
+    // Directories pushed and not finished yet, the walk is over when it drops to 0.
+    std::atomic<long long int> numPending(1);
+    // Directories waiting in the stacks, and workers sleeping until one is pushed. Pushers
+    // only take idleMtx when numIdle is not 0.
+    std::atomic<long long int> numQueued(1);
+    std::atomic<int> numIdle(0);
+    std::mutex idleMtx;
+    std::condition_variable idleCond;
+    workers[0].dirs.push_back(endsWithSlash(directoryName) ?
+        directoryName.substr(0, directoryName.size() - 1) : directoryName);
+
+    auto work = [&](int index)
+    {
+        Worker& self = workers[index];
+        std::string dirPath;
+        while (numPending.load(std::memory_order_acquire) > 0)
+        {
+            bool found = false;
+            {
+                std::lock_guard<std::mutex> lg(self.mtx);
+                if (!self.dirs.empty())
+                {
+                    dirPath.swap(self.dirs.back());
+                    self.dirs.pop_back();
+                    numQueued.fetch_sub(1, std::memory_order_relaxed);
+                    found = true;
+                }
+            }
+            for (int i = 1; !found && i < numThreads; i++)
+            {
+                Worker& victim = workers[(index + i) % numThreads];
+                std::lock_guard<std::mutex> lg(victim.mtx);
+                if (!victim.dirs.empty())
+                {
+                    dirPath.swap(victim.dirs.front());
+                    victim.dirs.pop_front();
+                    numQueued.fetch_sub(1, std::memory_order_relaxed);
+                    found = true;
+                }
+            }
+            if (!found)
+            {
+                std::unique_lock<std::mutex> lock(idleMtx);
+                numIdle.fetch_add(1);
+                idleCond.wait(lock, [&] { return numQueued.load() > 0 || numPending.load() == 0; });
+                numIdle.fetch_sub(1);
+                continue;
+            }
+
+            DirectoryReader reader(dirPath);
+            while (reader.next())
+            {
+                if (reader.isDirectory())
+                {
+                    numPending.fetch_add(1, std::memory_order_relaxed);
+                    {
+                        std::lock_guard<std::mutex> lg(self.mtx);
+                        self.dirs.push_back(reader.path());
+                    }
+                    numQueued.fetch_add(1);
+                    if (numIdle.load() > 0)
+                    {
+                        std::lock_guard<std::mutex> lg(idleMtx);
+                        idleCond.notify_one();
+                    }
+                }
+                if (func(reader.path()))
+                    self.results.push_back(reader.path());
+            }
+            if (numPending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                std::lock_guard<std::mutex> lg(idleMtx);
+                idleCond.notify_all();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++)
+        threads.push_back(std::thread(work, i));
+    work(0);
+    for (std::thread& thread : threads)
+        thread.join();
+
+    size_t total = 0;
+    for (const Worker& worker : workers)
+        total += worker.results.size();
+    fileNames.reserve(total);
+    for (Worker& worker : workers)
+        fileNames.insert(fileNames.end(), worker.results.begin(), worker.results.end());
+}
+
 inline std::string getFileNameExtension(const std::string& name)
 {
     std::string::size_type pos = name.find_last_of(".");
@@ -350,8 +759,107 @@ inline bool containsLMDB(const std::string& path)
     return false;
 }
 
+#ifdef __linux__
+// Copy the whole content of srcFd into dstFd, both at offset 0, without going through user
+// space when the file systems allow: reflink with FICLONE, which shares the data blocks,
+// then copy_file_range, then sendfile, and only then read and write.
+// Each method continues from where the previous one stopped, and the copy always ends with
+// read until the end of file. size, the size reported by stat, is only a hint: files of
+// procfs report 0 and the kernel methods copy nothing from them, so they are skipped then.
+// Return false if fewer than size bytes could be copied.
+inline bool copyFileContent(int srcFd, int dstFd, long long int size)
+{
+#ifdef FICLONE
+    if (size > 0 && ioctl(dstFd, FICLONE, srcFd) == 0)
+        return true;
+#endif
+
+    long long int copied = 0;
+    // Cleared at the end of file, or when a method fails, to go on with the next one.
+    bool kernelCopy = size > 0;
+#ifdef SYS_copy_file_range
+    while (kernelCopy)
+    {
+        loff_t srcOffset = copied, dstOffset = copied;
+        ssize_t len = syscall(SYS_copy_file_range, srcFd, &srcOffset, dstFd, &dstOffset, (size_t)1 << 30, 0);
+        if (len <= 0)
+        {
+            kernelCopy = len < 0;
+            break;
+        }
+        copied += len;
+    }
+#endif
+
+    while (kernelCopy)
+    {
+        if (lseek(dstFd, copied, SEEK_SET) < 0)
+            break;
+        off_t offset = copied;
+        ssize_t len = sendfile(dstFd, srcFd, &offset, (size_t)1 << 30);
+        if (len <= 0)
+            break;
+        copied += len;
+    }
+
+    if (lseek(dstFd, copied, SEEK_SET) < 0)
+        return false;
+    std::vector<char> buf;
+    while (true)
+    {
+        // Once the kernel has copied size bytes, a small read is enough to find the end.
+        buf.resize(copied < size || !buf.empty() ? 1 << 20 : 4096);
+        ssize_t len = pread(srcFd, buf.data(), buf.size(), copied);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            return false;
+        if (len == 0)
+            break;
+        for (ssize_t done = 0; done < len; )
+        {
+            ssize_t written = write(dstFd, buf.data() + done, len - done);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            done += written;
+        }
+        copied += len;
+    }
+    return copied >= size;
+}
+#endif
+
+// Copy a regular file, keeping its permission bits on POSIX systems.
 inline bool copyFile(const std::string& src, const std::string& dst)
 {
+#ifdef __linux__
+    int srcFd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (srcFd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(srcFd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        close(srcFd);
+        return false;
+    }
+
+    int dstFd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 07777);
+    if (dstFd < 0)
+    {
+        close(srcFd);
+        return false;
+    }
+
+    bool ok = copyFileContent(srcFd, dstFd, (long long int)info.st_size);
+    // The mode given to open only applies when dst is created.
+    ok = fchmod(dstFd, info.st_mode & 07777) == 0 && ok;
+    ok = close(dstFd) == 0 && ok;
+    close(srcFd);
+    return ok;
+#else
     if (!isRegularFile(src))
         return false;
 
@@ -369,7 +877,73 @@ inline bool copyFile(const std::string& src, const std::string& dst)
     ifs.close();
     ofs.close();
 
+#ifndef _WIN32
+    struct stat info;
+    if (stat(src.c_str(), &info) == 0)
+        chmod(dst.c_str(), info.st_mode & 07777);
+#endif
     return true;
+#endif
+}
+
+// Copy the directory tree srcDir into dstDir, which is created if needed.
+// The tree is listed with collectFilesRecursively, so symbolic links are copied as the
+// files and directories they point to. Directories are created first, then files are
+// copied by numThreads threads, so at most numThreads copies are in flight at a time.
+// Return false if any directory or file could not be copied, after trying all of them.
+inline bool copyDirectory(const std::string& srcDir, const std::string& dstDir, int numThreads = 4)
+{
+    if (!isDirectory(srcDir))
+        return false;
+
+    std::vector<std::string> paths;
+    collectFilesRecursively(srcDir, paths, [](const std::string&) { return true; });
+
+    std::string srcRoot = endsWithSlash(srcDir) ? srcDir.substr(0, srcDir.size() - 1) : srcDir;
+    std::string dstRoot = endsWithSlash(dstDir) ? dstDir.substr(0, dstDir.size() - 1) : dstDir;
+    if (!isDirectory(dstRoot) && createDirectory(dstRoot) != 0)
+        return false;
+
+    bool ok = true;
+    std::vector<std::pair<std::string, std::string> > files;
+    int numPaths = (int)paths.size();
+    for (int i = 0; i < numPaths; i++)
+    {
+        std::string dst = dstRoot + paths[i].substr(srcRoot.size());
+        FileInfo info;
+        if (!getFileInfo(paths[i], info))
+            ok = false;
+        else if (info.type == FILE_TYPE_DIRECTORY)
+        {
+            if (!isDirectory(dst) && createDirectory(dst) != 0)
+                ok = false;
+        }
+        else if (info.type == FILE_TYPE_REGULAR)
+            files.push_back(std::make_pair(paths[i], dst));
+    }
+
+    std::atomic<int> nextFile(0);
+    std::atomic<bool> allCopied(true);
+    int numFiles = (int)files.size();
+    auto work = [&]()
+    {
+        int index;
+        while ((index = nextFile.fetch_add(1)) < numFiles)
+        {
+            if (!copyFile(files[index].first, files[index].second))
+                allCopied = false;
+        }
+    };
+
+    numThreads = std::max(1, std::min(numThreads, numFiles));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++)
+        threads.push_back(std::thread(work));
+    work();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    return ok && allCopied;
 }
 
 #ifndef _WIN32
@@ -1,6 +1,9 @@
 ﻿#pragma once
 
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
 
 template<typename Type>
 struct Group
@@ -19,7 +22,8 @@ struct Group
             return false;
 
         Type val = item;
-        avgVal = (avgVal * items.size() + val) * (1.0 / (items.size() + 1));
+        // Convert the size first, a size_t product wraps for negative integral values.
+        avgVal = (avgVal * Type(items.size()) + val) * (1.0 / (items.size() + 1));
         minVal = std::min(minVal, val);
         maxVal = std::max(maxVal, val);
 
@@ -28,19 +32,31 @@ struct Group
         return true;
     }
 
+    void merge(const Group<Type>& other)
+    {
+        avgVal = (avgVal * Type(items.size()) + other.avgVal * Type(other.items.size())) *
+            (1.0 / (items.size() + other.items.size()));
+        minVal = std::min(minVal, other.minVal);
+        maxVal = std::max(maxVal, other.maxVal);
+
+        items.insert(items.end(), other.items.begin(), other.items.end());
+    }
+
     Type thresh;
     Type avgVal;
     Type minVal, maxVal;
     std::vector<Type> items;
 };
 
+// Same as the vector version below, on items[0] ... items[size - 1].
 template<typename Type>
-void groupItems(const std::vector<Type>& items, Type thresh, std::vector<Group<Type> >& groups)
+void groupItems(const Type* items, int size, Type thresh, std::vector<Group<Type> >& groups)
 {
     groups.clear();
 
-    for (const Type& item : items)
+    for (int i = 0; i < size; i++)
     {
+        const Type& item = items[i];
         bool ok = false;
         for (Group<Type>& group : groups)
         {
@@ -58,6 +74,114 @@ void groupItems(const std::vector<Type>& items, Type thresh, std::vector<Group<T
         [](const Group<Type>& lhs, const Group<Type>& rhs) { return lhs.avgVal > rhs.avgVal; });
 }
 
+template<typename Type>
+void groupItems(const std::vector<Type>& items, Type thresh, std::vector<Group<Type> >& groups)
+{
+    groupItems(items.data(), (int)items.size(), thresh, groups);
+}
+
+// Sort-and-sweep version of groupItems, O(n log n) instead of O(n * g).
+// Items are visited in ascending order and each one is only tested against the
+// last opened group, using the same admission rule as Group::tryAdd.
+// The result is NOT identical to groupItems in general, since the greedy version
+// depends on the input order. Every group still satisfies the tryAdd rule at the
+// time each item is added, groups do not overlap, and the output is likewise
+// sorted by avgVal in descending order.
+template<typename Type>
+void groupItemsSorted(const std::vector<Type>& items, Type thresh, std::vector<Group<Type> >& groups)
+{
+    groups.clear();
+
+    std::vector<Type> sortedItems(items);
+    std::sort(sortedItems.begin(), sortedItems.end());
+
+    for (const Type& item : sortedItems)
+    {
+        if (groups.empty() || !groups.back().tryAdd(item))
+            groups.push_back(Group<Type>(item, thresh));
+    }
+
+    // Groups are created with non-decreasing avgVal.
+    std::reverse(groups.begin(), groups.end());
+}
+
+// Merge the groups built from different chunks of the input. Groups of all chunks are
+// visited in ascending avgVal order, ties keep the chunk order, and a group is merged into
+// the previous merged group if their avgVal are within thresh and that merged group does
+// not already hold a group of the same chunk. Groups of one chunk are never merged with
+// each other, since the greedy pass has already kept them apart.
+// On return groups are sorted by avgVal in descending order.
+template<typename GroupType, typename Type>
+void mergeChunkGroups(std::vector<std::vector<GroupType> >& chunkGroups, Type thresh,
+    std::vector<GroupType>& groups)
+{
+    groups.clear();
+
+    int numChunks = (int)chunkGroups.size();
+    std::vector<std::pair<GroupType*, int> > order;
+    for (int i = 0; i < numChunks; i++)
+    {
+        for (GroupType& group : chunkGroups[i])
+            order.push_back(std::make_pair(&group, i));
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [](const std::pair<GroupType*, int>& lhs, const std::pair<GroupType*, int>& rhs)
+        { return lhs.first->avgVal < rhs.first->avgVal; });
+
+    // Index in groups of the last merged group holding a group of each chunk.
+    std::vector<int> lastMerged(numChunks, -1);
+    for (std::pair<GroupType*, int>& entry : order)
+    {
+        int last = (int)groups.size() - 1;
+        if (last >= 0 && lastMerged[entry.second] != last &&
+            abs(entry.first->avgVal - groups.back().avgVal) <= thresh)
+            groups.back().merge(*entry.first);
+        else
+        {
+            groups.push_back(std::move(*entry.first));
+            last++;
+        }
+        lastMerged[entry.second] = last;
+    }
+
+    std::reverse(groups.begin(), groups.end());
+}
+
+// Multi-threaded version of groupItems.
+// items are split into numThreads contiguous chunks, each chunk is grouped by groupItems
+// in its own thread, then groups of different chunks are merged by mergeChunkGroups.
+// The result is deterministic for a fixed numThreads. With one thread it is groupItems,
+// otherwise it differs from groupItems, and in general from runs with another numThreads,
+// since groups may be split across chunk boundaries differently.
+template<typename Type>
+void groupItemsParallel(const std::vector<Type>& items, Type thresh, std::vector<Group<Type> >& groups,
+    int numThreads = 4)
+{
+    if (numThreads <= 1)
+    {
+        groupItems(items, thresh, groups);
+        return;
+    }
+
+    int size = (int)items.size();
+    std::vector<std::vector<Group<Type> > > chunkGroups(numThreads);
+    auto groupChunk = [&](int index)
+    {
+        int beg = (int)((long long int)size * index / numThreads);
+        int end = (int)((long long int)size * (index + 1) / numThreads);
+        groupItems(items.data() + beg, end - beg, thresh, chunkGroups[index]);
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++)
+        threads.push_back(std::thread(groupChunk, i));
+    groupChunk(0);
+    for (std::thread& t : threads)
+        t.join();
+
+    mergeChunkGroups(chunkGroups, thresh, groups);
+}
+
 template<typename ItemType, typename ComputeType, typename GetValueFunc>
 struct Group2
 {
@@ -65,18 +189,19 @@ struct Group2
         thresh(threshold_), avgVal(0), minVal(0), maxVal(0), func(func_) {}
 
     Group2(ItemType item_, GetValueFunc func_, ComputeType threshold_ = 20) :
-        thresh(threshold_), avgVal(func_(item_)), minVal(func_(item_)), maxVal(func_(item_)), func(func_)
+        thresh(threshold_), avgVal(func_(item_)), minVal(avgVal), maxVal(avgVal), func(func_)
     {
         items.push_back(item_);
     }
 
     bool tryAdd(ItemType item)
     {
-        if (abs(func(item) - avgVal) > thresh)
+        auto key = func(item);
+        if (abs(key - avgVal) > thresh)
             return false;
 
-        ComputeType val = func(item);
-        avgVal = (avgVal * items.size() + val) * (1.0 / (items.size() + 1));
+        ComputeType val = key;
+        avgVal = (avgVal * ComputeType(items.size()) + val) * (1.0 / (items.size() + 1));
         minVal = std::min(minVal, val);
         maxVal = std::max(maxVal, val);
 
@@ -85,6 +210,16 @@ struct Group2
         return true;
     }
 
+    void merge(const Group2<ItemType, ComputeType, GetValueFunc>& other)
+    {
+        avgVal = (avgVal * ComputeType(items.size()) + other.avgVal * ComputeType(other.items.size())) *
+            (1.0 / (items.size() + other.items.size()));
+        minVal = std::min(minVal, other.minVal);
+        maxVal = std::max(maxVal, other.maxVal);
+
+        items.insert(items.end(), other.items.begin(), other.items.end());
+    }
+
     ComputeType thresh;
     ComputeType avgVal;
     ComputeType minVal, maxVal;
@@ -92,14 +227,16 @@ struct Group2
     GetValueFunc func;
 };
 
+// Same as the vector version below, on items[0] ... items[size - 1].
 template<typename ItemType, typename ComputeType, typename GetValueFunc>
-void groupItems2(const std::vector<ItemType>& items, GetValueFunc func, ComputeType thresh, 
+void groupItems2(const ItemType* items, int size, GetValueFunc func, ComputeType thresh,
     std::vector<Group2<ItemType, ComputeType, GetValueFunc> >& groups)
 {
     groups.clear();
 
-    for (const ItemType& item : items)
+    for (int i = 0; i < size; i++)
     {
+        const ItemType& item = items[i];
         bool ok = false;
         for (Group2<ItemType, ComputeType, GetValueFunc>& group : groups)
         {
@@ -116,4 +253,319 @@ void groupItems2(const std::vector<ItemType>& items, GetValueFunc func, ComputeT
     std::sort(groups.begin(), groups.end(),
         [](const Group2<ItemType, ComputeType, GetValueFunc>& lhs, const Group2<ItemType, ComputeType, GetValueFunc>& rhs) 
         { return lhs.avgVal > rhs.avgVal; });
-}
\ No newline at end of file
+}
+
+template<typename ItemType, typename ComputeType, typename GetValueFunc>
+void groupItems2(const std::vector<ItemType>& items, GetValueFunc func, ComputeType thresh, 
+    std::vector<Group2<ItemType, ComputeType, GetValueFunc> >& groups)
+{
+    groupItems2(items.data(), (int)items.size(), func, thresh, groups);
+}
+
+// Sort-and-sweep version of groupItems2, see groupItemsSorted for the semantics.
+// func is evaluated once per item for sorting, tryAdd still evaluates it again.
+template<typename ItemType, typename ComputeType, typename GetValueFunc>
+void groupItems2Sorted(const std::vector<ItemType>& items, GetValueFunc func, ComputeType thresh,
+    std::vector<Group2<ItemType, ComputeType, GetValueFunc> >& groups)
+{
+    groups.clear();
+
+    int size = (int)items.size();
+    std::vector<std::pair<ComputeType, int> > keys(size);
+    for (int i = 0; i < size; i++)
+        keys[i] = std::make_pair(ComputeType(func(items[i])), i);
+    std::sort(keys.begin(), keys.end());
+
+    for (int i = 0; i < size; i++)
+    {
+        const ItemType& item = items[keys[i].second];
+        if (groups.empty() || !groups.back().tryAdd(item))
+            groups.push_back(Group2<ItemType, ComputeType, GetValueFunc>(item, func, thresh));
+    }
+
+    std::reverse(groups.begin(), groups.end());
+}
+
+// Multi-threaded version of groupItems2, see groupItemsParallel for the semantics.
+template<typename ItemType, typename ComputeType, typename GetValueFunc>
+void groupItems2Parallel(const std::vector<ItemType>& items, GetValueFunc func, ComputeType thresh,
+    std::vector<Group2<ItemType, ComputeType, GetValueFunc> >& groups, int numThreads = 4)
+{
+    typedef Group2<ItemType, ComputeType, GetValueFunc> GroupType;
+
+    if (numThreads <= 1)
+    {
+        groupItems2(items, func, thresh, groups);
+        return;
+    }
+
+    int size = (int)items.size();
+    std::vector<std::vector<GroupType> > chunkGroups(numThreads);
+    auto groupChunk = [&](int index)
+    {
+        int beg = (int)((long long int)size * index / numThreads);
+        int end = (int)((long long int)size * (index + 1) / numThreads);
+        groupItems2(items.data() + beg, end - beg, func, thresh, chunkGroups[index]);
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++)
+        threads.push_back(std::thread(groupChunk, i));
+    groupChunk(0);
+    for (std::thread& t : threads)
+        t.join();
+
+    mergeChunkGroups(chunkGroups, thresh, groups);
+}
+
+// Stateful grouping with a sliding window, for input that changes little between calls,
+// e.g. consecutive video frames.
+// Items are added one by one with a time stamp, and are evicted in the order they were
+// added, either when there are more than maxCount items (maxCount > 0), or when they are
+// older than maxAge relative to the stamp passed to evict (maxAge > 0).
+// Each item goes to the oldest live group whose avgVal is within thresh, as in groupItems,
+// so the cost of an update is proportional to the number of added and evicted items,
+// not to the whole history.
+// avgVal is the exact mean of the live keys, truncated for integral types, so it can
+// differ slightly from the incremental mean computed by Group::tryAdd.
+template<typename ItemType, typename ComputeType>
+class GroupWindow
+{
+public:
+    GroupWindow(ComputeType threshold = 20, int maxCount_ = 0, double maxAge_ = 0) :
+        thresh(threshold), maxCount(maxCount_), maxAge(maxAge_), numLive(0) {}
+
+    void evict(double now)
+    {
+        if (maxAge > 0)
+        {
+            while (!entries.empty() && entries.front().stamp < now - maxAge)
+                evictOldest();
+        }
+    }
+
+    void clear()
+    {
+        entries.clear();
+        slots.clear();
+        freeSlots.clear();
+        liveSlots.clear();
+        numLive = 0;
+    }
+
+    int size() const
+    {
+        return (int)entries.size();
+    }
+
+    int numGroups() const
+    {
+        return numLive;
+    }
+
+protected:
+    struct Slot
+    {
+        ComputeType avgVal;
+        ComputeType minVal, maxVal;
+        double sum;
+        int head;
+        std::vector<ItemType> items;
+        std::vector<ComputeType> keys;
+    };
+
+    struct Entry
+    {
+        double stamp;
+        int slot;
+    };
+
+    void addItem(const ItemType& item, ComputeType key, double stamp)
+    {
+        // Freed slots are reused, so slot indexes do not follow the creation order,
+        // liveSlots does.
+        int index = -1;
+        for (int i : liveSlots)
+        {
+            if (abs(key - slots[i].avgVal) <= thresh)
+            {
+                index = i;
+                break;
+            }
+        }
+
+        if (index < 0)
+        {
+            if (freeSlots.empty())
+            {
+                index = (int)slots.size();
+                slots.push_back(Slot());
+            }
+            else
+            {
+                index = freeSlots.back();
+                freeSlots.pop_back();
+            }
+            Slot& slot = slots[index];
+            slot.avgVal = slot.minVal = slot.maxVal = key;
+            slot.sum = 0;
+            slot.head = 0;
+            liveSlots.push_back(index);
+            numLive++;
+        }
+
+        Slot& slot = slots[index];
+        slot.sum += key;
+        slot.minVal = std::min(slot.minVal, key);
+        slot.maxVal = std::max(slot.maxVal, key);
+        slot.items.push_back(item);
+        slot.keys.push_back(key);
+        slot.avgVal = ComputeType(slot.sum / (slot.keys.size() - slot.head));
+
+        Entry entry;
+        entry.stamp = stamp;
+        entry.slot = index;
+        entries.push_back(entry);
+
+        if (maxCount > 0)
+        {
+            while ((int)entries.size() > maxCount)
+                evictOldest();
+        }
+    }
+
+    // Items of a slot are stored in the order they were added, so the oldest
+    // entry of the window is always at the head of its slot.
+    void evictOldest()
+    {
+        Slot& slot = slots[entries.front().slot];
+        entries.pop_front();
+
+        ComputeType key = slot.keys[slot.head];
+        slot.head++;
+        int count = (int)slot.keys.size() - slot.head;
+        if (count == 0)
+        {
+            slot.items.clear();
+            slot.keys.clear();
+            slot.head = 0;
+            int index = (int)(&slot - slots.data());
+            freeSlots.push_back(index);
+            liveSlots.erase(std::find(liveSlots.begin(), liveSlots.end(), index));
+            numLive--;
+            return;
+        }
+
+        if (slot.head > 16 && slot.head * 2 > (int)slot.keys.size())
+        {
+            slot.items.erase(slot.items.begin(), slot.items.begin() + slot.head);
+            slot.keys.erase(slot.keys.begin(), slot.keys.begin() + slot.head);
+            slot.head = 0;
+        }
+
+        slot.sum -= key;
+        slot.avgVal = ComputeType(slot.sum / count);
+        if (key == slot.minVal || key == slot.maxVal)
+        {
+            slot.minVal = *std::min_element(slot.keys.begin() + slot.head, slot.keys.end());
+            slot.maxVal = *std::max_element(slot.keys.begin() + slot.head, slot.keys.end());
+        }
+    }
+
+    ComputeType thresh;
+    int maxCount;
+    double maxAge;
+    int numLive;
+    std::deque<Entry> entries;
+    std::vector<Slot> slots;
+    std::vector<int> freeSlots;
+    // Indexes of the live slots, oldest group first.
+    std::vector<int> liveSlots;
+};
+
+template<typename Type>
+class GroupTracker : public GroupWindow<Type, Type>
+{
+public:
+    GroupTracker(Type threshold = 20, int maxCount_ = 0, double maxAge_ = 0) :
+        GroupWindow<Type, Type>(threshold, maxCount_, maxAge_) {}
+
+    void add(Type item, double stamp)
+    {
+        this->addItem(item, item, stamp);
+    }
+
+    void add(const std::vector<Type>& items, double stamp)
+    {
+        for (const Type& item : items)
+            this->addItem(item, item, stamp);
+    }
+
+    // Copy out the live groups, sorted by avgVal in descending order.
+    void getGroups(std::vector<Group<Type> >& groups) const
+    {
+        groups.clear();
+        for (const typename GroupWindow<Type, Type>::Slot& slot : this->slots)
+        {
+            if (slot.head == (int)slot.keys.size())
+                continue;
+
+            Group<Type> group;
+            group.thresh = this->thresh;
+            group.avgVal = slot.avgVal;
+            group.minVal = slot.minVal;
+            group.maxVal = slot.maxVal;
+            group.items.assign(slot.items.begin() + slot.head, slot.items.end());
+            groups.push_back(std::move(group));
+        }
+
+        std::sort(groups.begin(), groups.end(),
+            [](const Group<Type>& lhs, const Group<Type>& rhs) { return lhs.avgVal > rhs.avgVal; });
+    }
+};
+
+// GetValueFunc is evaluated exactly once per added item.
+template<typename ItemType, typename ComputeType, typename GetValueFunc>
+class GroupTracker2 : public GroupWindow<ItemType, ComputeType>
+{
+public:
+    GroupTracker2(GetValueFunc func_, ComputeType threshold = 20, int maxCount_ = 0, double maxAge_ = 0) :
+        GroupWindow<ItemType, ComputeType>(threshold, maxCount_, maxAge_), func(func_) {}
+
+    void add(const ItemType& item, double stamp)
+    {
+        this->addItem(item, func(item), stamp);
+    }
+
+    void add(const std::vector<ItemType>& items, double stamp)
+    {
+        for (const ItemType& item : items)
+            this->addItem(item, func(item), stamp);
+    }
+
+    // Copy out the live groups, sorted by avgVal in descending order.
+    void getGroups(std::vector<Group2<ItemType, ComputeType, GetValueFunc> >& groups) const
+    {
+        typedef Group2<ItemType, ComputeType, GetValueFunc> GroupType;
+
+        groups.clear();
+        for (const typename GroupWindow<ItemType, ComputeType>::Slot& slot : this->slots)
+        {
+            if (slot.head == (int)slot.keys.size())
+                continue;
+
+            GroupType group(func, this->thresh);
+            group.avgVal = slot.avgVal;
+            group.minVal = slot.minVal;
+            group.maxVal = slot.maxVal;
+            group.items.assign(slot.items.begin() + slot.head, slot.items.end());
+            groups.push_back(std::move(group));
+        }
+
+        std::sort(groups.begin(), groups.end(),
+            [](const GroupType& lhs, const GroupType& rhs) { return lhs.avgVal > rhs.avgVal; });
+    }
+
+private:
+    GetValueFunc func;
+};
\ No newline at end of file
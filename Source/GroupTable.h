@@ -0,0 +1,316 @@
+﻿#pragma once
+
+#include <stdlib.h>
+#include <cmath>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define GROUP_TABLE_SSE2 1
+#endif
+
+#ifdef _WIN32
+#include <malloc.h>
+#include <intrin.h>
+#endif
+
+template<typename Type, int Alignment = 32>
+struct AlignedAllocator
+{
+    typedef Type value_type;
+
+    template<typename Other>
+    struct rebind
+    {
+        typedef AlignedAllocator<Other, Alignment> other;
+    };
+
+    AlignedAllocator() {}
+
+    template<typename Other>
+    AlignedAllocator(const AlignedAllocator<Other, Alignment>&) {}
+
+    Type* allocate(std::size_t n)
+    {
+        std::size_t bytes = (n * sizeof(Type) + Alignment - 1) / Alignment * Alignment;
+#ifdef _WIN32
+        void* ptr = _aligned_malloc(bytes, Alignment);
+#else
+        void* ptr = 0;
+        if (posix_memalign(&ptr, Alignment, bytes) != 0)
+            ptr = 0;
+#endif
+        if (!ptr)
+            throw std::bad_alloc();
+        return static_cast<Type*>(ptr);
+    }
+
+    void deallocate(Type* ptr, std::size_t)
+    {
+#ifdef _WIN32
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+
+    template<typename Other>
+    bool operator==(const AlignedAllocator<Other, Alignment>&) const { return true; }
+
+    template<typename Other>
+    bool operator!=(const AlignedAllocator<Other, Alignment>&) const { return false; }
+};
+
+inline int lowestSetBit(unsigned int mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Return the index of the first value within thresh of item, or -1 if there is none.
+// Scalar version, used for any Type without a SIMD kernel.
+template<typename Type>
+inline int findFirstWithin(const Type* vals, int size, Type item, Type thresh)
+{
+    for (int i = 0; i < size; i++)
+    {
+        if (!(std::abs(item - vals[i]) > thresh))
+            return i;
+    }
+    return -1;
+}
+
+// AVX2 tests 16 values per iteration, SSE2 tests 8.
+inline int findFirstWithin(const float* vals, int size, float item, float thresh)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256 vItem = _mm256_set1_ps(item);
+    __m256 vThresh = _mm256_set1_ps(thresh);
+    __m256 vSign = _mm256_set1_ps(-0.0f);
+    for (; i + 16 <= size; i += 16)
+    {
+        __m256 d0 = _mm256_andnot_ps(vSign, _mm256_sub_ps(_mm256_loadu_ps(vals + i), vItem));
+        __m256 d1 = _mm256_andnot_ps(vSign, _mm256_sub_ps(_mm256_loadu_ps(vals + i + 8), vItem));
+        unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(d0, vThresh, _CMP_LE_OQ)) |
+            ((unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(d1, vThresh, _CMP_LE_OQ)) << 8);
+        if (mask)
+            return i + lowestSetBit(mask);
+    }
+#elif defined(GROUP_TABLE_SSE2)
+    __m128 vItem = _mm_set1_ps(item);
+    __m128 vThresh = _mm_set1_ps(thresh);
+    __m128 vSign = _mm_set1_ps(-0.0f);
+    for (; i + 8 <= size; i += 8)
+    {
+        __m128 d0 = _mm_andnot_ps(vSign, _mm_sub_ps(_mm_loadu_ps(vals + i), vItem));
+        __m128 d1 = _mm_andnot_ps(vSign, _mm_sub_ps(_mm_loadu_ps(vals + i + 4), vItem));
+        unsigned int mask = (unsigned int)_mm_movemask_ps(_mm_cmple_ps(d0, vThresh)) |
+            ((unsigned int)_mm_movemask_ps(_mm_cmple_ps(d1, vThresh)) << 4);
+        if (mask)
+            return i + lowestSetBit(mask);
+    }
+#endif
+    for (; i < size; i++)
+    {
+        if (std::abs(item - vals[i]) <= thresh)
+            return i;
+    }
+    return -1;
+}
+
+inline int findFirstWithin(const int* vals, int size, int item, int thresh)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i vItem = _mm256_set1_epi32(item);
+    __m256i vThresh = _mm256_set1_epi32(thresh);
+    for (; i + 16 <= size; i += 16)
+    {
+        __m256i d0 = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(vals + i)), vItem));
+        __m256i d1 = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(vals + i + 8)), vItem));
+        unsigned int reject = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(d0, vThresh))) |
+            ((unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(d1, vThresh))) << 8);
+        unsigned int mask = ~reject & 0xffff;
+        if (mask)
+            return i + lowestSetBit(mask);
+    }
+#elif defined(GROUP_TABLE_SSE2)
+    __m128i vItem = _mm_set1_epi32(item);
+    __m128i vThresh = _mm_set1_epi32(thresh);
+    for (; i + 8 <= size; i += 8)
+    {
+        __m128i d0 = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(vals + i)), vItem);
+        __m128i d1 = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(vals + i + 4)), vItem);
+        __m128i s0 = _mm_srai_epi32(d0, 31), s1 = _mm_srai_epi32(d1, 31);
+        d0 = _mm_sub_epi32(_mm_xor_si128(d0, s0), s0);
+        d1 = _mm_sub_epi32(_mm_xor_si128(d1, s1), s1);
+        unsigned int reject = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(d0, vThresh))) |
+            ((unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(d1, vThresh))) << 4);
+        unsigned int mask = ~reject & 0xff;
+        if (mask)
+            return i + lowestSetBit(mask);
+    }
+#endif
+    for (; i < size; i++)
+    {
+        if (abs(item - vals[i]) <= thresh)
+            return i;
+    }
+    return -1;
+}
+
+// Structure-of-arrays counterpart of std::vector<Group<Type> >.
+// Statistics of all groups are kept in contiguous aligned arrays, so that the nearest
+// group search can test many centroids at once with findFirstWithin.
+// Membership is stored as item indexes in CSR form: the items of group i are
+// indexes[offsets[i]] ... indexes[offsets[i + 1] - 1], in input order.
+// Buffers keep their capacity across calls.
+template<typename Type>
+struct GroupTable
+{
+    typedef std::vector<Type, AlignedAllocator<Type> > ValueArray;
+
+    GroupTable(Type threshold = 20) : thresh(threshold) {}
+
+    void clear()
+    {
+        avgVals.clear();
+        minVals.clear();
+        maxVals.clear();
+        counts.clear();
+        labels.clear();
+        offsets.clear();
+        indexes.clear();
+        keys.clear();
+    }
+
+    int numGroups() const
+    {
+        return (int)avgVals.size();
+    }
+
+    // Add an item with the same rule as groupItems, return its group index.
+    int add(Type item)
+    {
+        int index = findFirstWithin(avgVals.data(), (int)avgVals.size(), item, thresh);
+        if (index < 0)
+        {
+            index = (int)avgVals.size();
+            avgVals.push_back(item);
+            minVals.push_back(item);
+            maxVals.push_back(item);
+            counts.push_back(1);
+        }
+        else
+        {
+            int count = counts[index];
+            avgVals[index] = (avgVals[index] * count + item) * (1.0 / (count + 1));
+            minVals[index] = std::min(minVals[index], item);
+            maxVals[index] = std::max(maxVals[index], item);
+            counts[index] = count + 1;
+        }
+        labels.push_back(index);
+        return index;
+    }
+
+    // Sort groups by avgVal in descending order and build offsets and indexes.
+    void finish()
+    {
+        int size = numGroups();
+        order.resize(size);
+        for (int i = 0; i < size; i++)
+            order[i] = i;
+        // Ties are broken by creation order, as a stable sort would, without the
+        // temporary buffer std::stable_sort allocates.
+        std::sort(order.begin(), order.end(), [this](int lhs, int rhs)
+            { return avgVals[lhs] > avgVals[rhs] || (avgVals[lhs] == avgVals[rhs] && lhs < rhs); });
+
+        rank.resize(size);
+        offsets.assign(size + 1, 0);
+        for (int i = 0; i < size; i++)
+        {
+            rank[order[i]] = i;
+            offsets[i + 1] = offsets[i] + counts[order[i]];
+        }
+        permute(avgVals, tempVals);
+        permute(minVals, tempVals);
+        permute(maxVals, tempVals);
+        permute(counts, tempCounts);
+
+        int numItems = (int)labels.size();
+        indexes.resize(numItems);
+        cursors.assign(offsets.begin(), offsets.end() - 1);
+        for (int i = 0; i < numItems; i++)
+        {
+            labels[i] = rank[labels[i]];
+            indexes[cursors[labels[i]]++] = i;
+        }
+    }
+
+    Type thresh;
+    ValueArray avgVals;
+    ValueArray minVals, maxVals;
+    std::vector<int> counts;
+    std::vector<int> labels;
+    std::vector<int> offsets;
+    std::vector<int> indexes;
+    // Keys computed by groupItems2.
+    std::vector<Type> keys;
+
+private:
+    // temp ends up holding the old buffer of vals, so the buffers only swap around
+    // and keep their capacity.
+    template<typename Array>
+    void permute(Array& vals, Array& temp)
+    {
+        int size = (int)vals.size();
+        temp.resize(size);
+        for (int i = 0; i < size; i++)
+            temp[i] = vals[order[i]];
+        vals.swap(temp);
+    }
+
+    std::vector<int> order, rank, cursors;
+    ValueArray tempVals;
+    std::vector<int> tempCounts;
+};
+
+// Same grouping as groupItems, written into a GroupTable.
+// Groups with equal avgVal keep their creation order, while groupItems leaves it unspecified.
+// For floating point Type the distance is always computed in floating point, while the
+// unqualified abs in Group::tryAdd resolves to the int overload unless <math.h> is included.
+template<typename Type>
+void groupItems(const std::vector<Type>& items, Type thresh, GroupTable<Type>& table)
+{
+    table.clear();
+    table.thresh = thresh;
+    for (const Type& item : items)
+        table.add(item);
+    table.finish();
+}
+
+// Same grouping as groupItems2, written into a GroupTable.
+// func is evaluated exactly once per item, the keys are kept in table.keys.
+template<typename ItemType, typename ComputeType, typename GetValueFunc>
+void groupItems2(const std::vector<ItemType>& items, GetValueFunc func, ComputeType thresh,
+    GroupTable<ComputeType>& table)
+{
+    table.clear();
+    table.thresh = thresh;
+    int size = (int)items.size();
+    table.keys.resize(size);
+    for (int i = 0; i < size; i++)
+        table.keys[i] = func(items[i]);
+    for (int i = 0; i < size; i++)
+        table.add(table.keys[i]);
+    table.finish();
+}
@@ -1,12 +1,29 @@
 ﻿#include <mutex>
 #include <vector>
 #include "Log.h"
+#include "AsyncLogSink.h"
+#include "MappedLogSink.h"
+#include "RotatingArchiveSink.h"
+#include "spdlog/sinks/stdout_sinks.h"
+#include "spdlog/sinks/rotating_file_sink.h"
 
 static bool init = false;
 static std::mutex mtx;
+static std::shared_ptr<AsyncLogSink> asyncSink;
+static std::mutex sitesMtx;
+static std::vector<LogSite*> suppressingSites;
 std::shared_ptr<spdlog::logger> logger;
 
 void initLogger(bool hasStdOut, int fileSize, int numFiles)
+{
+    LoggerConfig config;
+    config.hasStdOut = hasStdOut;
+    config.fileSize = fileSize;
+    config.numFiles = numFiles;
+    initLogger(config);
+}
+
+void initLogger(const LoggerConfig& config)
 {
     if (!init)
     {
@@ -16,13 +33,53 @@ void initLogger(bool hasStdOut, int fileSize, int numFiles)
             init = true;
             
             std::vector<spdlog::sink_ptr> sinks;
-            if (hasStdOut)
+            if (config.hasStdOut)
                 sinks.push_back(std::make_shared<spdlog::sinks::stdout_sink_mt>());
-            sinks.push_back(std::make_shared<spdlog::sinks::rotating_file_sink_mt>("logfile", fileSize, numFiles));
+            if (config.archive)
+                sinks.push_back(std::make_shared<RotatingArchiveSink>("logfile", config.fileSize, config.compressArchives,
+                    config.maxArchiveBytes, config.maxArchiveAgeSeconds, config.numFiles));
+            else
+                sinks.push_back(std::make_shared<spdlog::sinks::rotating_file_sink_mt>("logfile", config.fileSize, config.numFiles));
+            if (config.async)
+            {
+                asyncSink = std::make_shared<AsyncLogSink>(sinks, config.queueSize, config.overflowPolicy);
+                sinks.assign(1, asyncSink);
+            }
+#ifndef _WIN32
+            if (!config.crashLogPath.empty())
+                sinks.push_back(std::make_shared<MappedLogSink>(config.crashLogPath, config.crashLogSize));
+#endif
             logger = std::make_shared<spdlog::logger>("logger", begin(sinks), end(sinks));
             spdlog::register_logger(logger);
             //spdlog::set_pattern("[%Y-%m-%d %H:%M:%S.%e] [%L] [T %t] %v");
             spdlog::set_pattern("%m%d %H:%M:%S.%e %L %t %v");
         }
     }
-}
\ No newline at end of file
+}
+
+unsigned long long int numDroppedLogs()
+{
+    return asyncSink ? asyncSink->numDropped() : 0;
+}
+
+void LogSite::registerSuppressingLogSite(LogSite* site)
+{
+    std::lock_guard<std::mutex> lg(sitesMtx);
+    suppressingSites.push_back(site);
+}
+
+void shutdownLogger()
+{
+    if (!logger)
+        return;
+    {
+        std::lock_guard<std::mutex> lg(sitesMtx);
+        for (LogSite* site : suppressingSites)
+        {
+            unsigned long long int count = site->takeSuppressed();
+            if (count)
+                logger->log(site->level, "{}[{} similar messages suppressed]", site->prefix(), count);
+        }
+    }
+    logger->flush();
+}
@@ -1,9 +1,54 @@
 ﻿#pragma once
 
 #include <memory>
+#include <string>
 #include "spdlog/spdlog.h"
 
+// What log calls do when the queue of an AsyncLogSink is full.
+enum LogOverflowPolicy
+{
+    LOG_OVERFLOW_BLOCK,       // wait for the writer thread to make room, nothing is lost
+    LOG_OVERFLOW_DROP_NEWEST, // discard the message being logged
+    LOG_OVERFLOW_DROP_OLDEST  // discard the oldest queued message
+};
+
+struct LoggerConfig
+{
+    LoggerConfig() :
+        hasStdOut(true), fileSize(16 * 1024 * 1024), numFiles(4),
+        async(false), queueSize(8192), overflowPolicy(LOG_OVERFLOW_BLOCK), crashLogSize(4 * 1024 * 1024),
+        archive(false), compressArchives(true), maxArchiveBytes(0), maxArchiveAgeSeconds(0) {}
+
+    bool hasStdOut;
+    int fileSize;
+    int numFiles;
+    // Write to the sinks from a dedicated thread through a bounded queue of queueSize messages,
+    // see AsyncLogSink.
+    bool async;
+    int queueSize;
+    LogOverflowPolicy overflowPolicy;
+    // If not empty, also keep the last crashLogSize bytes of messages in a memory mapped file,
+    // written synchronously even in async mode, see MappedLogSink. Ignored on Windows.
+    std::string crashLogPath;
+    int crashLogSize;
+    // Rotate through RotatingArchiveSink: rotated files are gzipped in the background and
+    // pruned to maxArchiveBytes in total and maxArchiveAgeSeconds, or to numFiles files
+    // when both are 0.
+    bool archive;
+    bool compressArchives;
+    long long int maxArchiveBytes;
+    int maxArchiveAgeSeconds;
+};
+
 void initLogger(bool hasStdOut = true, int fileSize = 16 * 1024 *1024, int numFiles = 4);
+void initLogger(const LoggerConfig& config);
+
+// Number of messages discarded by the async queue, always 0 in synchronous mode.
+unsigned long long int numDroppedLogs();
+
+// Log how many calls of each _RATE_LIMITED site were suppressed since its last message, and
+// flush the sinks. Call it before the program exits, the logger stays usable afterwards.
+void shutdownLogger();
 
 extern std::shared_ptr<spdlog::logger> logger;
 
@@ -37,6 +82,11 @@ extern std::shared_ptr<spdlog::logger> logger;
 #else
 
 #include <string.h>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <type_traits>
 inline const char* shortFileName(const char* fileName)
 {
 #ifdef _WIN32
@@ -47,6 +97,100 @@ inline const char* shortFileName(const char* fileName)
     return ptr ? ptr + 1 : fileName;
 }
 
+constexpr size_t baseNameOffset(const char* path, size_t begin, size_t end);
+
+constexpr size_t baseNameOffsetOr(size_t right, const char* path, size_t begin, size_t end)
+{
+    return right ? right : baseNameOffset(path, begin, end);
+}
+
+// Offset just past the last separator in path[begin, end), 0 if there is none, evaluated
+// at compile time for __FILE__. The range is halved at each level, so the recursion depth
+// only grows with the logarithm of the path length, far below the constexpr depth limit.
+constexpr size_t baseNameOffset(const char* path, size_t begin, size_t end)
+{
+    return end - begin == 0 ? 0 :
+        end - begin == 1 ? ((path[begin] == '/' || path[begin] == '\\') ? begin + 1 : 0) :
+        baseNameOffsetOr(baseNameOffset(path, begin + (end - begin) / 2, end), path, begin, begin + (end - begin) / 2);
+}
+
+// Call site of a LOG_* macro, created once per site on its first enabled call.
+// The "file line function: " header of the messages is formatted here once, and then
+// passed to spdlog as a single string argument.
+// The counters serve the _EVERY_N and _RATE_LIMITED macros, they are lock free and exact
+// when many threads log from the same site.
+struct LogSite
+{
+    LogSite(const char* file_, int line_, const char* function_, spdlog::level::level_enum level_) :
+        file(file_), line(line_), function(function_), level(level_),
+        header(std::string(file_) + " " + std::to_string(line_) + " " + function_ + ": "),
+        hits(0), window(0), suppressed(0), registered(false) {}
+
+    spdlog::string_view_t prefix() const
+    {
+        return spdlog::string_view_t(header.data(), header.size());
+    }
+
+    // Let the 1st, (n + 1)th, (2n + 1)th ... call through.
+    bool sampleEveryN(unsigned long long int n)
+    {
+        return n <= 1 || hits.fetch_add(1, std::memory_order_relaxed) % n == 0;
+    }
+
+    // Let at most perSecond calls through in every second of the steady clock.
+    // The second and the count of calls in it share one atomic word, so that a new second
+    // and its first call are accounted for at once.
+    bool allowRate(int perSecond)
+    {
+        const unsigned long long int countBits = 24, countMask = (1ULL << countBits) - 1;
+        unsigned long long int second = (unsigned long long int)std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        unsigned long long int limit = perSecond < 1 ? 1 : std::min((unsigned long long int)perSecond, countMask);
+        unsigned long long int cur = window.load(std::memory_order_relaxed);
+        while (true)
+        {
+            unsigned long long int next;
+            if ((cur >> countBits) != second)
+                next = (second << countBits) | 1;
+            else if ((cur & countMask) < limit)
+                next = cur + 1;
+            else
+            {
+                suppressed.fetch_add(1, std::memory_order_relaxed);
+                if (!registered.load(std::memory_order_relaxed) && !registered.exchange(true, std::memory_order_relaxed))
+                    registerSuppressingLogSite(this);
+                return false;
+            }
+            if (window.compare_exchange_weak(cur, next, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    // Number of calls filtered out by allowRate since the previous call, reported with the
+    // next message, or by shutdownLogger.
+    unsigned long long int takeSuppressed()
+    {
+        return suppressed.load(std::memory_order_relaxed) ? suppressed.exchange(0, std::memory_order_relaxed) : 0;
+    }
+
+    const char* file;
+    int line;
+    const char* function;
+    spdlog::level::level_enum level;
+    std::string header;
+    std::atomic<unsigned long long int> hits;
+    std::atomic<unsigned long long int> window;
+    std::atomic<unsigned long long int> suppressed;
+    std::atomic<bool> registered;
+
+private:
+    // Remember a site which suppressed calls, so that shutdownLogger can report them.
+    static void registerSuppressingLogSite(LogSite* site);
+};
+
+// path must be a string literal, e.g. __FILE__.
+#define LOG_BASE_NAME(path) ((path) + std::integral_constant<size_t, baseNameOffset(path, 0, sizeof(path) - 1)>::value)
+
 // IMPORTANT NOTICE!!!
 // In the following, we use implicit argument indexing to insert file, line and function name in the log,
 // which disables the flexible numbered argument indexing. That is to say, the following expression is
@@ -87,13 +231,75 @@ inline const char* shortFileName(const char* fileName)
 #define LOG_FATAL(msg, ...) logger->critical("[{} {} {}] " msg, shortFileName(__FILE__), __LINE__, __FUNCTION_NAME__, ##__VA_ARGS__)
 */
 
-#define LOG_TRACE(msg, ...) logger->trace("{} {} {}: " msg, shortFileName(__FILE__), __LINE__, __FUNCTION_NAME__, ##__VA_ARGS__)
-#define LOG_DEBUG(msg, ...) logger->debug("{} {} {}: " msg, shortFileName(__FILE__), __LINE__, __FUNCTION_NAME__, ##__VA_ARGS__)
-#define LOG_INFO(msg, ...) logger->info("{} {} {}: " msg, shortFileName(__FILE__), __LINE__, __FUNCTION_NAME__, ##__VA_ARGS__)
-#define LOG_WARNING(msg, ...) logger->warn("{} {} {}: " msg, shortFileName(__FILE__), __LINE__, __FUNCTION_NAME__, ##__VA_ARGS__)
-#define LOG_ERROR(msg, ...) logger->error("{} {} {}: " msg, shortFileName(__FILE__), __LINE__, __FUNCTION_NAME__, ##__VA_ARGS__)
-#define LOG_CRITICAL(msg, ...) logger->critical("{} {} {}: " msg, shortFileName(__FILE__), __LINE__, __FUNCTION_NAME__, ##__VA_ARGS__)
-#define LOG_FATAL(msg, ...) logger->critical("{} {} {}: " msg, shortFileName(__FILE__), __LINE__, __FUNCTION_NAME__, ##__VA_ARGS__)
+// Minimum level compiled in, call sites below it expand to dead code: their arguments are
+// still type checked, but never evaluated and no code is generated for them.
+// Release builds keep INFO and above unless LOG_ACTIVE_LEVEL is defined otherwise.
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARNING 3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_CRITICAL 5
+#define LOG_LEVEL_OFF 6
+
+#ifndef LOG_ACTIVE_LEVEL
+#ifdef NDEBUG
+#define LOG_ACTIVE_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_ACTIVE_LEVEL LOG_LEVEL_TRACE
+#endif
+#endif
+
+// The runtime level of logger is checked first, so arguments of disabled messages are not evaluated.
+#define LOG_AT_LEVEL(lvl, enabled, msg, ...) \
+    do { if ((enabled) && logger->should_log(lvl)) { \
+        static LogSite logSite(LOG_BASE_NAME(__FILE__), __LINE__, __FUNCTION_NAME__, lvl); \
+        logger->log(lvl, "{}" msg, logSite.prefix(), ##__VA_ARGS__); } } while (0)
+
+// Same as LOG_AT_LEVEL, but only log if the call passes filter, a LogSite member call.
+#define LOG_AT_LEVEL_FILTERED(lvl, enabled, filter, msg, ...) \
+    do { if ((enabled) && logger->should_log(lvl)) { \
+        static LogSite logSite(LOG_BASE_NAME(__FILE__), __LINE__, __FUNCTION_NAME__, lvl); \
+        if (logSite.filter) \
+            logger->log(lvl, "{}" msg, logSite.prefix(), ##__VA_ARGS__); } } while (0)
+
+// Same as LOG_AT_LEVEL, but log at most perSecond calls per second. The first message after
+// suppressed ones tells how many were suppressed, shutdownLogger reports the remaining ones.
+#define LOG_AT_LEVEL_RATE_LIMITED(lvl, enabled, perSecond, msg, ...) \
+    do { if ((enabled) && logger->should_log(lvl)) { \
+        static LogSite logSite(LOG_BASE_NAME(__FILE__), __LINE__, __FUNCTION_NAME__, lvl); \
+        if (logSite.allowRate(perSecond)) { \
+            unsigned long long int logSuppressed = logSite.takeSuppressed(); \
+            if (logSuppressed) \
+                logger->log(lvl, "{}" msg " [{} similar messages suppressed]", logSite.prefix(), ##__VA_ARGS__, logSuppressed); \
+            else \
+                logger->log(lvl, "{}" msg, logSite.prefix(), ##__VA_ARGS__); } } } while (0)
+
+#define LOG_TRACE(msg, ...) LOG_AT_LEVEL(spdlog::level::trace, LOG_ACTIVE_LEVEL <= LOG_LEVEL_TRACE, msg, ##__VA_ARGS__)
+#define LOG_DEBUG(msg, ...) LOG_AT_LEVEL(spdlog::level::debug, LOG_ACTIVE_LEVEL <= LOG_LEVEL_DEBUG, msg, ##__VA_ARGS__)
+#define LOG_INFO(msg, ...) LOG_AT_LEVEL(spdlog::level::info, LOG_ACTIVE_LEVEL <= LOG_LEVEL_INFO, msg, ##__VA_ARGS__)
+#define LOG_WARNING(msg, ...) LOG_AT_LEVEL(spdlog::level::warn, LOG_ACTIVE_LEVEL <= LOG_LEVEL_WARNING, msg, ##__VA_ARGS__)
+#define LOG_ERROR(msg, ...) LOG_AT_LEVEL(spdlog::level::err, LOG_ACTIVE_LEVEL <= LOG_LEVEL_ERROR, msg, ##__VA_ARGS__)
+#define LOG_CRITICAL(msg, ...) LOG_AT_LEVEL(spdlog::level::critical, LOG_ACTIVE_LEVEL <= LOG_LEVEL_CRITICAL, msg, ##__VA_ARGS__)
+#define LOG_FATAL(msg, ...) LOG_AT_LEVEL(spdlog::level::critical, LOG_ACTIVE_LEVEL <= LOG_LEVEL_CRITICAL, msg, ##__VA_ARGS__)
+
+// Log the 1st of every n calls of the site.
+#define LOG_TRACE_EVERY_N(n, msg, ...) LOG_AT_LEVEL_FILTERED(spdlog::level::trace, LOG_ACTIVE_LEVEL <= LOG_LEVEL_TRACE, sampleEveryN(n), msg, ##__VA_ARGS__)
+#define LOG_DEBUG_EVERY_N(n, msg, ...) LOG_AT_LEVEL_FILTERED(spdlog::level::debug, LOG_ACTIVE_LEVEL <= LOG_LEVEL_DEBUG, sampleEveryN(n), msg, ##__VA_ARGS__)
+#define LOG_INFO_EVERY_N(n, msg, ...) LOG_AT_LEVEL_FILTERED(spdlog::level::info, LOG_ACTIVE_LEVEL <= LOG_LEVEL_INFO, sampleEveryN(n), msg, ##__VA_ARGS__)
+#define LOG_WARNING_EVERY_N(n, msg, ...) LOG_AT_LEVEL_FILTERED(spdlog::level::warn, LOG_ACTIVE_LEVEL <= LOG_LEVEL_WARNING, sampleEveryN(n), msg, ##__VA_ARGS__)
+#define LOG_ERROR_EVERY_N(n, msg, ...) LOG_AT_LEVEL_FILTERED(spdlog::level::err, LOG_ACTIVE_LEVEL <= LOG_LEVEL_ERROR, sampleEveryN(n), msg, ##__VA_ARGS__)
+#define LOG_CRITICAL_EVERY_N(n, msg, ...) LOG_AT_LEVEL_FILTERED(spdlog::level::critical, LOG_ACTIVE_LEVEL <= LOG_LEVEL_CRITICAL, sampleEveryN(n), msg, ##__VA_ARGS__)
+#define LOG_FATAL_EVERY_N(n, msg, ...) LOG_AT_LEVEL_FILTERED(spdlog::level::critical, LOG_ACTIVE_LEVEL <= LOG_LEVEL_CRITICAL, sampleEveryN(n), msg, ##__VA_ARGS__)
+
+// Log at most n calls of the site per second.
+#define LOG_TRACE_RATE_LIMITED(n, msg, ...) LOG_AT_LEVEL_RATE_LIMITED(spdlog::level::trace, LOG_ACTIVE_LEVEL <= LOG_LEVEL_TRACE, n, msg, ##__VA_ARGS__)
+#define LOG_DEBUG_RATE_LIMITED(n, msg, ...) LOG_AT_LEVEL_RATE_LIMITED(spdlog::level::debug, LOG_ACTIVE_LEVEL <= LOG_LEVEL_DEBUG, n, msg, ##__VA_ARGS__)
+#define LOG_INFO_RATE_LIMITED(n, msg, ...) LOG_AT_LEVEL_RATE_LIMITED(spdlog::level::info, LOG_ACTIVE_LEVEL <= LOG_LEVEL_INFO, n, msg, ##__VA_ARGS__)
+#define LOG_WARNING_RATE_LIMITED(n, msg, ...) LOG_AT_LEVEL_RATE_LIMITED(spdlog::level::warn, LOG_ACTIVE_LEVEL <= LOG_LEVEL_WARNING, n, msg, ##__VA_ARGS__)
+#define LOG_ERROR_RATE_LIMITED(n, msg, ...) LOG_AT_LEVEL_RATE_LIMITED(spdlog::level::err, LOG_ACTIVE_LEVEL <= LOG_LEVEL_ERROR, n, msg, ##__VA_ARGS__)
+#define LOG_CRITICAL_RATE_LIMITED(n, msg, ...) LOG_AT_LEVEL_RATE_LIMITED(spdlog::level::critical, LOG_ACTIVE_LEVEL <= LOG_LEVEL_CRITICAL, n, msg, ##__VA_ARGS__)
+#define LOG_FATAL_RATE_LIMITED(n, msg, ...) LOG_AT_LEVEL_RATE_LIMITED(spdlog::level::critical, LOG_ACTIVE_LEVEL <= LOG_LEVEL_CRITICAL, n, msg, ##__VA_ARGS__)
 
 #endif
 
@@ -0,0 +1,218 @@
+﻿#ifndef _WIN32
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include "MappedLogSink.h"
+
+static const char mappedLogMagic[4] = { 'M', 'L', 'O', 'G' };
+static const unsigned int mappedLogVersion = 1;
+static const size_t headerSize = 4096;
+static const unsigned int recordHeaderSize = 24;
+static const unsigned int paddingSequence = 0;
+
+struct MappedLogHeader
+{
+    char magic[4];
+    unsigned int version;
+    unsigned long long int capacity;
+    unsigned long long int writePos;
+    unsigned long long int sequence;
+};
+
+static unsigned int checksum(unsigned long long int sequence, const char* data, unsigned int len)
+{
+    unsigned int h = 2166136261u ^ (unsigned int)sequence ^ (unsigned int)(sequence >> 32);
+    for (unsigned int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)data[i]) * 16777619u;
+    return h;
+}
+
+MappedLogSink::MappedLogSink(const std::string& path, int capacity_) :
+    fd(-1), base(0), mappedSize(0), capacity(((unsigned long long int)std::max(capacity_, 4096) + 7) & ~7ULL),
+    writePos(0), sequence(0)
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return;
+
+    mappedSize = headerSize + capacity;
+    struct stat st;
+    bool reuse = fstat(fd, &st) == 0 && (size_t)st.st_size == mappedSize;
+    if (!reuse && ftruncate(fd, mappedSize) != 0)
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    void* ptr = mmap(0, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+    base = (char*)ptr;
+
+    MappedLogHeader* header = (MappedLogHeader*)base;
+    if (reuse && memcmp(header->magic, mappedLogMagic, 4) == 0 && header->version == mappedLogVersion &&
+        header->capacity == capacity)
+    {
+        writePos = header->writePos;
+        sequence = header->sequence;
+    }
+    else
+    {
+        memset(base, 0, headerSize);
+        memcpy(header->magic, mappedLogMagic, 4);
+        header->version = mappedLogVersion;
+        header->capacity = capacity;
+    }
+}
+
+MappedLogSink::~MappedLogSink()
+{
+    if (base)
+    {
+        msync(base, mappedSize, MS_ASYNC);
+        munmap(base, mappedSize);
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+void MappedLogSink::sink_it_(const spdlog::details::log_msg& msg)
+{
+    if (!base)
+        return;
+
+    spdlog::memory_buf_t formatted;
+    formatter_->format(msg, formatted);
+    write(formatted.data(), (unsigned int)formatted.size());
+}
+
+// Only schedule write back, the page cache already survives a crash of the process.
+void MappedLogSink::flush_()
+{
+    if (base)
+        msync(base, mappedSize, MS_ASYNC);
+}
+
+void MappedLogSink::write(const char* data, unsigned int len)
+{
+    unsigned long long int maxLen = capacity / 2 - recordHeaderSize;
+    if (len > maxLen)
+        len = (unsigned int)maxLen;
+
+    char* ring = base + headerSize;
+    unsigned int recordSize = (recordHeaderSize + len + 7) & ~7U;
+    unsigned long long int pos = writePos % capacity;
+    if (pos + recordSize > capacity)
+    {
+        // Padding record, with sequence 0 which no message uses.
+        unsigned int paddingSize = (unsigned int)(capacity - pos);
+        memcpy(ring + pos, &paddingSize, 4);
+        if (paddingSize >= 16)
+        {
+            memcpy(ring + pos + 4, mappedLogMagic, 4);
+            unsigned long long int seq = paddingSequence;
+            memcpy(ring + pos + 8, &seq, 8);
+        }
+        writePos += paddingSize;
+        pos = 0;
+    }
+
+    unsigned long long int seq = ++sequence;
+    unsigned int sum = checksum(seq, data, len);
+    char* ptr = ring + pos;
+    memcpy(ptr + recordHeaderSize, data, len);
+    memcpy(ptr + 4, mappedLogMagic, 4);
+    memcpy(ptr + 8, &seq, 8);
+    memcpy(ptr + 16, &sum, 4);
+    memcpy(ptr + 20, &len, 4);
+    memcpy(ptr, &recordSize, 4);
+    writePos += recordSize;
+
+    MappedLogHeader* header = (MappedLogHeader*)base;
+    header->writePos = writePos;
+    header->sequence = sequence;
+}
+
+bool readMappedLogTail(const std::string& path, std::vector<std::string>& lines)
+{
+    lines.clear();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size <= headerSize)
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void* ptr = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return false;
+
+    const char* base = (const char*)ptr;
+    const MappedLogHeader* header = (const MappedLogHeader*)base;
+    unsigned long long int capacity = header->capacity;
+    if (memcmp(header->magic, mappedLogMagic, 4) != 0 || header->version != mappedLogVersion ||
+        capacity % 8 != 0 || headerSize + capacity != size)
+    {
+        munmap(ptr, size);
+        return false;
+    }
+
+    // Records are found by scanning, since the write position may be behind the last
+    // record which reached memory before a crash, and older records are partly overwritten.
+    const char* ring = base + headerSize;
+    std::vector<std::pair<unsigned long long int, unsigned long long int> > found;
+    unsigned long long int pos = 0;
+    while (pos + recordHeaderSize <= capacity)
+    {
+        const char* rec = ring + pos;
+        unsigned int recordSize, len, sum;
+        unsigned long long int seq;
+        memcpy(&recordSize, rec, 4);
+        memcpy(&seq, rec + 8, 8);
+        memcpy(&sum, rec + 16, 4);
+        memcpy(&len, rec + 20, 4);
+        if (memcmp(rec + 4, mappedLogMagic, 4) == 0 && seq != paddingSequence &&
+            recordSize == ((recordHeaderSize + len + 7) & ~7U) && pos + recordSize <= capacity &&
+            checksum(seq, rec + recordHeaderSize, len) == sum)
+        {
+            found.push_back(std::make_pair(seq, pos));
+            pos += recordSize;
+        }
+        else
+            pos += 8;
+    }
+
+    std::sort(found.begin(), found.end());
+    int first = (int)found.size() - 1;
+    while (first > 0 && found[first - 1].first + 1 == found[first].first)
+        first--;
+    for (int i = std::max(first, 0); i < (int)found.size(); i++)
+    {
+        const char* rec = ring + found[i].second;
+        unsigned int len;
+        memcpy(&len, rec + 20, 4);
+        std::string line(rec + recordHeaderSize, len);
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+            line.pop_back();
+        lines.push_back(line);
+    }
+
+    munmap(ptr, size);
+    return true;
+}
+
+#endif
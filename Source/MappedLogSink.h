@@ -0,0 +1,55 @@
+﻿#pragma once
+
+#ifndef _WIN32
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/base_sink.h"
+
+// Sink writing formatted messages into a circular file mapped in memory.
+// Messages land in the page cache as soon as they are logged, so the kernel keeps them
+// when the process crashes, without any fsync per message. After a restart,
+// readMappedLogTail recovers the newest messages in order.
+// File layout: a header page with "MLOG", version, capacity and the write position,
+// followed by capacity bytes of ring. Every record is 8 byte aligned, never wraps around
+// the end of the ring, and holds u32 size, u32 "MLOG", u64 sequence number, u32 checksum,
+// u32 length and the message, so that torn or overwritten records can be detected.
+// Reopening an existing file with the same capacity appends after its last record.
+class MappedLogSink : public spdlog::sinks::base_sink<std::mutex>
+{
+public:
+    MappedLogSink(const std::string& path, int capacity = 4 * 1024 * 1024);
+    ~MappedLogSink();
+
+    // False if the file could not be created or mapped, messages are then discarded.
+    bool valid() const
+    {
+        return base != 0;
+    }
+
+protected:
+    void sink_it_(const spdlog::details::log_msg& msg) override;
+    void flush_() override;
+
+private:
+    MappedLogSink(const MappedLogSink&);
+    MappedLogSink& operator=(const MappedLogSink&);
+
+    void write(const char* data, unsigned int len);
+
+    int fd;
+    char* base;
+    size_t mappedSize;
+    unsigned long long int capacity;
+    unsigned long long int writePos;
+    unsigned long long int sequence;
+};
+
+// Read the messages still present in a file of MappedLogSink, oldest first. Stop at the
+// first gap in sequence numbers going back from the newest message, so lines only ever
+// holds a contiguous tail. Return false if path is not such a file.
+bool readMappedLogTail(const std::string& path, std::vector<std::string>& lines);
+
+#endif
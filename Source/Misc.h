@@ -9,6 +9,8 @@
 #include "opencv2/imgproc.hpp"
 #include "opencv2/highgui.hpp"
 
+#include "TickClock.h"
+
 template<typename ElemType>
 bool equals(const std::vector<ElemType>& lhs, const std::vector<ElemType>& rhs)
 {
@@ -291,82 +293,6 @@ inline void normalizeImageMaxLength(cv::Mat& src, int maxLength, cv::Mat& dst)
         normalizeImageWidth(src, maxLength, dst);
 }
 
-class Timer
-{
-public:
-    Timer()
-        : begTime(cv::getTickCount()), endTime(cv::getTickCount()), 
-          freq(cv::getTickFrequency()), elapsedTime(0)
-    {};
-
-    void begin() 
-    { 
-        begTime = cv::getTickCount(); 
-    };
-
-    void end() 
-    { 
-        endTime = cv::getTickCount(); 
-        elapsedTime = double(endTime - begTime) / freq;
-    };
-
-    double elapsed() const
-    {
-        return elapsedTime;
-    }
-
-private:
-    long long int begTime, endTime;
-    double freq, elapsedTime;
-};
-
-class AccumTimer
-{
-public:
-    AccumTimer() 
-    {
-        clear();
-    }
-
-    void begin()
-    {
-        t.begin();
-    }
-
-    void end()
-    {
-        t.end();
-        accum += t.elapsed();
-        count++;
-    }
-
-    double elapsed() const
-    {
-        return accum;
-    }
-
-    double num() const
-    {
-        return count;
-    }
-
-    double avgElapsed() const
-    {
-        return count ? accum / count : 0;
-    }
-
-    void clear()
-    {
-        count = 0;
-        accum = 0;
-    }
-
-private:
-    int count;
-    double accum;
-    Timer t;
-};
-
 inline bool horiOverlap(const cv::Rect& lhs, const cv::Rect& rhs)
 {
     int left = std::max(lhs.x, rhs.x);
@@ -0,0 +1,249 @@
+﻿#include <cstdio>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include "RotatingArchiveSink.h"
+#include "FileSystem.h"
+
+#ifndef LOG_NO_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+static const char* gzipSuffix = ".gz";
+static const char* tempSuffix = ".tmp";
+
+static bool endsWith(const std::string& str, const char* suffix)
+{
+    size_t len = strlen(suffix);
+    return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+}
+
+#ifndef LOG_NO_ZLIB
+// Write src gzipped into dst, through a temporary file so that dst is never partial.
+static bool gzipFile(const std::string& src, const std::string& dst)
+{
+    FILE* in = fopen(src.c_str(), "rb");
+    if (!in)
+        return false;
+
+    std::string temp = dst + tempSuffix;
+    gzFile out = gzopen(temp.c_str(), "wb6");
+    if (!out)
+    {
+        fclose(in);
+        return false;
+    }
+
+    std::vector<char> buf(256 * 1024);
+    bool ok = true;
+    size_t len;
+    while (ok && (len = fread(buf.data(), 1, buf.size(), in)) > 0)
+        ok = gzwrite(out, buf.data(), (unsigned int)len) == (int)len;
+    ok = !ferror(in) && ok;
+    fclose(in);
+    ok = gzclose(out) == Z_OK && ok;
+    if (ok)
+        ok = std::rename(temp.c_str(), dst.c_str()) == 0;
+    if (!ok)
+        std::remove(temp.c_str());
+    return ok;
+}
+#endif
+
+RotatingArchiveSink::RotatingArchiveSink(const std::string& baseName_, long long int fileSize_, bool compress_,
+    long long int maxTotalBytes_, int maxAgeSeconds_, int maxFiles_) :
+    baseName(baseName_), fileSize(fileSize_), compress(compress_), maxTotalBytes(maxTotalBytes_),
+    maxAgeSeconds(maxAgeSeconds_), maxFiles(maxFiles_), currentSize(0), counter(0), stopping(false)
+{
+#ifdef LOG_NO_ZLIB
+    compress = false;
+#endif
+    std::string::size_type pos = baseName.find_last_of("\\/");
+    dirName = pos == std::string::npos ? std::string(".") : baseName.substr(0, pos);
+    archivePrefix = getFileNameWithoutPath(baseName) + ".";
+
+    file.open(baseName, false);
+    currentSize = (long long int)file.size();
+
+    if (compress)
+    {
+        std::vector<std::string> names;
+        readDirectory(dirName, names);
+        std::sort(names.begin(), names.end());
+        for (const std::string& name : names)
+        {
+            if (isArchive(name) && !endsWith(name, gzipSuffix))
+                pending.push_back(dirName + "/" + name);
+        }
+    }
+    worker = std::thread(&RotatingArchiveSink::run, this);
+}
+
+RotatingArchiveSink::~RotatingArchiveSink()
+{
+    {
+        std::lock_guard<std::mutex> lg(queueMtx);
+        stopping = true;
+    }
+    queueCond.notify_one();
+    worker.join();
+}
+
+void RotatingArchiveSink::sink_it_(const spdlog::details::log_msg& msg)
+{
+    spdlog::memory_buf_t formatted;
+    formatter_->format(msg, formatted);
+    if (currentSize > 0 && currentSize + (long long int)formatted.size() > fileSize)
+        rotate();
+    file.write(formatted);
+    currentSize += (long long int)formatted.size();
+}
+
+void RotatingArchiveSink::flush_()
+{
+    file.flush();
+}
+
+// Only a rename happens here, under the lock of the sink.
+void RotatingArchiveSink::rotate()
+{
+    file.close();
+
+    time_t now = time(0);
+    struct tm tmVal;
+#ifdef _WIN32
+    localtime_s(&tmVal, &now);
+#else
+    localtime_r(&now, &tmVal);
+#endif
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tmVal);
+    std::string archived;
+    do
+    {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), ".%04d", counter++ % 10000);
+        archived = dirName + "/" + archivePrefix + stamp + suffix;
+    } while (exists(archived) || exists(archived + gzipSuffix));
+
+    bool renamed = std::rename(baseName.c_str(), archived.c_str()) == 0;
+    file.open(baseName, true);
+    currentSize = 0;
+
+    if (renamed)
+    {
+        {
+            std::lock_guard<std::mutex> lg(queueMtx);
+            pending.push_back(archived);
+        }
+        queueCond.notify_one();
+    }
+}
+
+void RotatingArchiveSink::run()
+{
+#ifdef __linux__
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+    prune();
+    while (true)
+    {
+        std::string path;
+        {
+            std::unique_lock<std::mutex> lock(queueMtx);
+            queueCond.wait(lock, [this] { return stopping || !pending.empty(); });
+            // Files not compressed yet at exit are picked up by the next run.
+            if (stopping)
+                break;
+            path = pending.front();
+            pending.pop_front();
+        }
+
+#ifndef LOG_NO_ZLIB
+        if (compress && gzipFile(path, path + gzipSuffix))
+            std::remove(path.c_str());
+#endif
+        prune();
+    }
+}
+
+// Archives are named <base>.<yyyymmdd-hhmmss>.<nnnn>, followed by .gz once compressed.
+bool RotatingArchiveSink::isArchive(const std::string& name) const
+{
+    static const char pattern[] = "########-######.####";
+    const size_t patternSize = sizeof(pattern) - 1;
+    size_t size = archivePrefix.size() + patternSize;
+    if ((name.size() != size && name.size() != size + strlen(gzipSuffix)) ||
+        name.compare(0, archivePrefix.size(), archivePrefix) != 0)
+        return false;
+    for (size_t i = 0; i < patternSize; i++)
+    {
+        char c = name[archivePrefix.size() + i];
+        if (pattern[i] == '#' ? (c < '0' || c > '9') : c != pattern[i])
+            return false;
+    }
+    return name.size() == size || name.compare(size, std::string::npos, gzipSuffix) == 0;
+}
+
+void RotatingArchiveSink::prune()
+{
+    std::vector<std::string> names;
+    readDirectory(dirName, names);
+    std::vector<std::string> archives;
+    for (const std::string& name : names)
+    {
+        if (isArchive(name))
+            archives.push_back(name);
+    }
+    // Names start with the rotation time, so the oldest archives come first.
+    std::sort(archives.begin(), archives.end());
+
+    // Files still waiting for compression do not count against the budget yet, otherwise
+    // their uncompressed size would push out older archives.
+    int numArchives = (int)archives.size();
+    std::vector<FileInfo> infos(numArchives);
+    std::vector<bool> waiting(numArchives);
+    long long int totalBytes = 0;
+    {
+        std::lock_guard<std::mutex> lg(queueMtx);
+        for (int i = 0; i < numArchives; i++)
+        {
+            std::string path = dirName + "/" + archives[i];
+            waiting[i] = std::find(pending.begin(), pending.end(), path) != pending.end();
+        }
+    }
+    for (int i = 0; i < numArchives; i++)
+    {
+        if (getFileInfo(dirName + "/" + archives[i], infos[i]) && !waiting[i])
+            totalBytes += infos[i].size;
+    }
+
+    // Archives which could not be removed are not freed, but they are left out of the budget,
+    // otherwise every newer archive would be deleted to make up for them.
+    long long int stuckBytes = 0;
+    bool limitCount = maxTotalBytes <= 0 && maxAgeSeconds <= 0;
+    time_t now = time(0);
+    for (int i = 0; i < numArchives; i++)
+    {
+        std::string path = dirName + "/" + archives[i];
+        bool expired = false;
+        if (limitCount)
+            expired = numArchives - i > maxFiles;
+        if (maxTotalBytes > 0 && totalBytes - stuckBytes > maxTotalBytes)
+            expired = true;
+        if (maxAgeSeconds > 0 && infos[i].type != FILE_TYPE_NONE && now - infos[i].mtime > maxAgeSeconds)
+            expired = true;
+        // A file still waiting for compression is left alone, a later pass deletes it.
+        if (!expired || waiting[i] || infos[i].type == FILE_TYPE_NONE)
+            continue;
+        if (std::remove(path.c_str()) == 0)
+            totalBytes -= infos[i].size;
+        else
+            stuckBytes += infos[i].size;
+    }
+}
@@ -0,0 +1,55 @@
+﻿#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/base_sink.h"
+#include "spdlog/details/file_helper.h"
+
+// Size based rotating file sink which leaves the slow work of rotation to a background thread.
+// When the current file would exceed fileSize, it is only closed and renamed to
+// "<baseName>.<yyyymmdd-hhmmss>.<n>", and a new file is opened, so logging threads never
+// wait for compression or deletion. A low priority thread then gzips the renamed file,
+// unless compress is false or LOG_NO_ZLIB is defined, and prunes the oldest archives until
+// they take at most maxTotalBytes and none is older than maxAgeSeconds. With neither limit
+// set, the newest maxFiles archives are kept, as rotating_file_sink does.
+// Archives left uncompressed by a previous run are picked up at construction.
+class RotatingArchiveSink : public spdlog::sinks::base_sink<std::mutex>
+{
+public:
+    RotatingArchiveSink(const std::string& baseName, long long int fileSize, bool compress = true,
+        long long int maxTotalBytes = 0, int maxAgeSeconds = 0, int maxFiles = 4);
+    ~RotatingArchiveSink();
+
+protected:
+    void sink_it_(const spdlog::details::log_msg& msg) override;
+    void flush_() override;
+
+private:
+    RotatingArchiveSink(const RotatingArchiveSink&);
+    RotatingArchiveSink& operator=(const RotatingArchiveSink&);
+
+    void rotate();
+    void run();
+    void prune();
+    bool isArchive(const std::string& name) const;
+
+    std::string baseName, dirName, archivePrefix;
+    long long int fileSize;
+    bool compress;
+    long long int maxTotalBytes;
+    int maxAgeSeconds;
+    int maxFiles;
+    spdlog::details::file_helper file;
+    long long int currentSize;
+    int counter;
+
+    std::mutex queueMtx;
+    std::condition_variable queueCond;
+    std::deque<std::string> pending;
+    bool stopping;
+    std::thread worker;
+};
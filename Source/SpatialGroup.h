@@ -0,0 +1,252 @@
+﻿#pragma once
+
+#include <cmath>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include "opencv2/core.hpp"
+
+// Multi-dimensional counterpart of Group, holding indexes of the grouped items.
+template<int Dims>
+struct SpatialGroup
+{
+    cv::Vec<double, Dims> avgVal;
+    cv::Vec<double, Dims> minVal, maxVal;
+    std::vector<int> indexes;
+};
+
+// Greedy multi-dimensional grouping with the same rule as groupItems: an item joins the
+// first created group whose avgVal is close enough, otherwise it starts a new group.
+// Close enough means either within radius in Euclidean distance, or within thresh[k]
+// along every axis k.
+// Group centroids are indexed by a uniform grid whose cells are as large as the threshold,
+// so only the 3^Dims cells around an item are visited, and the whole grouping is linear
+// in the number of items on average. Since every group within reach is tested and the
+// one created first wins, the result is identical to a linear scan over all groups.
+template<int Dims>
+class SpatialGrouper
+{
+public:
+    typedef cv::Vec<double, Dims> Key;
+
+    SpatialGrouper(double radius_) : perAxis(false), radius(radius_)
+    {
+        for (int k = 0; k < Dims; k++)
+        {
+            thresh[k] = radius_;
+            cellSize[k] = radius_ > 0 ? radius_ : 1;
+        }
+    }
+
+    SpatialGrouper(const Key& thresh_) : perAxis(true), radius(0), thresh(thresh_)
+    {
+        for (int k = 0; k < Dims; k++)
+            cellSize[k] = thresh_[k] > 0 ? thresh_[k] : 1;
+    }
+
+    void clear()
+    {
+        groups.clear();
+        groupCells.clear();
+        buckets.clear();
+    }
+
+    // Add an item, return the index of the group it goes to.
+    int add(const Key& key, int index)
+    {
+        long long int base[Dims], cell[Dims];
+        for (int k = 0; k < Dims; k++)
+            base[k] = cellOf(key[k], k);
+
+        int found = -1;
+        int offset[Dims];
+        for (int k = 0; k < Dims; k++)
+            offset[k] = -1;
+        while (true)
+        {
+            for (int k = 0; k < Dims; k++)
+                cell[k] = base[k] + offset[k];
+            typename std::unordered_map<size_t, std::vector<int> >::const_iterator itr = buckets.find(hashCell(cell));
+            if (itr != buckets.end())
+            {
+                for (int candidate : itr->second)
+                {
+                    if ((found < 0 || candidate < found) && isClose(key, groups[candidate].avgVal))
+                        found = candidate;
+                }
+            }
+
+            int k = 0;
+            while (k < Dims && offset[k] == 1)
+                offset[k++] = -1;
+            if (k == Dims)
+                break;
+            offset[k]++;
+        }
+
+        if (found < 0)
+        {
+            found = (int)groups.size();
+            SpatialGroup<Dims> group;
+            group.avgVal = group.minVal = group.maxVal = key;
+            group.indexes.push_back(index);
+            groups.push_back(group);
+            groupCells.push_back(hashCell(base));
+            buckets[groupCells.back()].push_back(found);
+            return found;
+        }
+
+        SpatialGroup<Dims>& group = groups[found];
+        double n = (double)group.indexes.size();
+        for (int k = 0; k < Dims; k++)
+        {
+            group.avgVal[k] = (group.avgVal[k] * n + key[k]) * (1.0 / (n + 1));
+            group.minVal[k] = std::min(group.minVal[k], key[k]);
+            group.maxVal[k] = std::max(group.maxVal[k], key[k]);
+            cell[k] = cellOf(group.avgVal[k], k);
+        }
+        group.indexes.push_back(index);
+
+        size_t newCell = hashCell(cell);
+        if (newCell != groupCells[found])
+        {
+            std::vector<int>& oldBucket = buckets[groupCells[found]];
+            oldBucket.erase(std::find(oldBucket.begin(), oldBucket.end(), found));
+            buckets[newCell].push_back(found);
+            groupCells[found] = newCell;
+        }
+        return found;
+    }
+
+    // Move the groups out, in the order they were created.
+    void finish(std::vector<SpatialGroup<Dims> >& groups_)
+    {
+        groups_.swap(groups);
+        clear();
+    }
+
+private:
+    long long int cellOf(double val, int k) const
+    {
+        return (long long int)std::floor(val / cellSize[k]);
+    }
+
+    // Different cells may share a hash value, which only costs extra distance tests.
+    static size_t hashCell(const long long int* cell)
+    {
+        unsigned long long int h = 1469598103934665603ULL;
+        for (int k = 0; k < Dims; k++)
+            h = (h ^ (unsigned long long int)cell[k]) * 1099511628211ULL;
+        return (size_t)(h ^ (h >> 32));
+    }
+
+    bool isClose(const Key& key, const Key& center) const
+    {
+        if (perAxis)
+        {
+            for (int k = 0; k < Dims; k++)
+            {
+                if (std::abs(key[k] - center[k]) > thresh[k])
+                    return false;
+            }
+            return true;
+        }
+
+        double dist = 0;
+        for (int k = 0; k < Dims; k++)
+            dist += (key[k] - center[k]) * (key[k] - center[k]);
+        return dist <= radius * radius;
+    }
+
+    bool perAxis;
+    double radius;
+    Key thresh;
+    Key cellSize;
+    std::vector<SpatialGroup<Dims> > groups;
+    std::vector<size_t> groupCells;
+    std::unordered_map<size_t, std::vector<int> > buckets;
+};
+
+template<int Dims>
+void groupItemsSpatial(const std::vector<cv::Vec<double, Dims> >& keys, SpatialGrouper<Dims>& grouper,
+    std::vector<SpatialGroup<Dims> >& groups)
+{
+    grouper.clear();
+    int size = (int)keys.size();
+    for (int i = 0; i < size; i++)
+        grouper.add(keys[i], i);
+    grouper.finish(groups);
+}
+
+template<int Dims>
+void groupItemsSpatial(const std::vector<cv::Vec<double, Dims> >& keys, double radius,
+    std::vector<SpatialGroup<Dims> >& groups)
+{
+    SpatialGrouper<Dims> grouper(radius);
+    groupItemsSpatial(keys, grouper, groups);
+}
+
+template<int Dims>
+void groupItemsSpatial(const std::vector<cv::Vec<double, Dims> >& keys, const cv::Vec<double, Dims>& thresh,
+    std::vector<SpatialGroup<Dims> >& groups)
+{
+    SpatialGrouper<Dims> grouper(thresh);
+    groupItemsSpatial(keys, grouper, groups);
+}
+
+template<typename DataType>
+void pointsToKeys(const std::vector<cv::Point_<DataType> >& points, std::vector<cv::Vec2d>& keys)
+{
+    int size = (int)points.size();
+    keys.resize(size);
+    for (int i = 0; i < size; i++)
+        keys[i] = cv::Vec2d(points[i].x, points[i].y);
+}
+
+// Segments are keyed on (x1, y1, x2, y2) as is, so segments with swapped end points
+// only fall into the same group if callers normalize the end point order first.
+template<typename DataType>
+void lineSegmentsToKeys(const std::vector<cv::Vec<DataType, 4> >& lineSegs, std::vector<cv::Vec4d>& keys)
+{
+    int size = (int)lineSegs.size();
+    keys.resize(size);
+    for (int i = 0; i < size; i++)
+        keys[i] = cv::Vec4d(lineSegs[i][0], lineSegs[i][1], lineSegs[i][2], lineSegs[i][3]);
+}
+
+template<typename DataType>
+void groupPoints(const std::vector<cv::Point_<DataType> >& points, double radius,
+    std::vector<SpatialGroup<2> >& groups)
+{
+    std::vector<cv::Vec2d> keys;
+    pointsToKeys(points, keys);
+    groupItemsSpatial(keys, radius, groups);
+}
+
+template<typename DataType>
+void groupPoints(const std::vector<cv::Point_<DataType> >& points, const cv::Vec2d& thresh,
+    std::vector<SpatialGroup<2> >& groups)
+{
+    std::vector<cv::Vec2d> keys;
+    pointsToKeys(points, keys);
+    groupItemsSpatial(keys, thresh, groups);
+}
+
+template<typename DataType>
+void groupLineSegments(const std::vector<cv::Vec<DataType, 4> >& lineSegs, double radius,
+    std::vector<SpatialGroup<4> >& groups)
+{
+    std::vector<cv::Vec4d> keys;
+    lineSegmentsToKeys(lineSegs, keys);
+    groupItemsSpatial(keys, radius, groups);
+}
+
+template<typename DataType>
+void groupLineSegments(const std::vector<cv::Vec<DataType, 4> >& lineSegs, const cv::Vec4d& thresh,
+    std::vector<SpatialGroup<4> >& groups)
+{
+    std::vector<cv::Vec4d> keys;
+    lineSegmentsToKeys(lineSegs, keys);
+    groupItemsSpatial(keys, thresh, groups);
+}
@@ -0,0 +1,164 @@
+﻿#pragma once
+
+// Monotonic tick clock without any dependency on OpenCV.
+// The backend is selected at compile time by defining TICK_CLOCK_BACKEND:
+// TICK_CLOCK_STEADY         std::chrono::steady_clock, portable
+// TICK_CLOCK_MONOTONIC_RAW  clock_gettime(CLOCK_MONOTONIC_RAW), Linux, default there
+// TICK_CLOCK_TSC            rdtsc, x86 only, calibrated against steady_clock at first use,
+//                           assumes an invariant TSC synchronized across cores
+// Ticks are kept raw and only converted to seconds when asked for.
+
+#define TICK_CLOCK_STEADY 0
+#define TICK_CLOCK_MONOTONIC_RAW 1
+#define TICK_CLOCK_TSC 2
+
+#ifndef TICK_CLOCK_BACKEND
+#ifdef __linux__
+#define TICK_CLOCK_BACKEND TICK_CLOCK_MONOTONIC_RAW
+#else
+#define TICK_CLOCK_BACKEND TICK_CLOCK_STEADY
+#endif
+#endif
+
+#include <chrono>
+
+#if TICK_CLOCK_BACKEND == TICK_CLOCK_MONOTONIC_RAW
+#include <time.h>
+#elif TICK_CLOCK_BACKEND == TICK_CLOCK_TSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#include <thread>
+#endif
+
+inline long long int getTicks()
+{
+#if TICK_CLOCK_BACKEND == TICK_CLOCK_MONOTONIC_RAW
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (long long int)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#elif TICK_CLOCK_BACKEND == TICK_CLOCK_TSC
+    return (long long int)__rdtsc();
+#else
+    return (long long int)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+#if TICK_CLOCK_BACKEND == TICK_CLOCK_TSC
+inline double calibrateTickFrequency()
+{
+    std::chrono::steady_clock::time_point begTime = std::chrono::steady_clock::now();
+    long long int begTicks = getTicks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
+    long long int endTicks = getTicks();
+    return double(endTicks - begTicks) / std::chrono::duration<double>(endTime - begTime).count();
+}
+#endif
+
+// Ticks per second.
+inline double getTickFrequency()
+{
+#if TICK_CLOCK_BACKEND == TICK_CLOCK_MONOTONIC_RAW
+    return 1e9;
+#elif TICK_CLOCK_BACKEND == TICK_CLOCK_TSC
+    static const double freq = calibrateTickFrequency();
+    return freq;
+#else
+    return double(std::chrono::steady_clock::period::den) / std::chrono::steady_clock::period::num;
+#endif
+}
+
+// Seconds per tick.
+inline double getTickPeriod()
+{
+    static const double period = 1.0 / getTickFrequency();
+    return period;
+}
+
+inline double ticksToSeconds(long long int ticks)
+{
+    return double(ticks) * getTickPeriod();
+}
+
+class Timer
+{
+public:
+    Timer()
+        : begTime(getTicks()), endTime(begTime), elapsedTicks(0)
+    {};
+
+    void begin()
+    {
+        begTime = getTicks();
+    };
+
+    void end()
+    {
+        endTime = getTicks();
+        elapsedTicks = endTime - begTime;
+    };
+
+    double elapsed() const
+    {
+        return ticksToSeconds(elapsedTicks);
+    }
+
+    long long int ticks() const
+    {
+        return elapsedTicks;
+    }
+
+private:
+    long long int begTime, endTime;
+    long long int elapsedTicks;
+};
+
+class AccumTimer
+{
+public:
+    AccumTimer()
+    {
+        clear();
+    }
+
+    void begin()
+    {
+        t.begin();
+    }
+
+    void end()
+    {
+        t.end();
+        accum += t.ticks();
+        count++;
+    }
+
+    double elapsed() const
+    {
+        return ticksToSeconds(accum);
+    }
+
+    double num() const
+    {
+        return count;
+    }
+
+    double avgElapsed() const
+    {
+        return count ? elapsed() / count : 0;
+    }
+
+    void clear()
+    {
+        count = 0;
+        accum = 0;
+    }
+
+private:
+    int count;
+    long long int accum;
+    Timer t;
+};
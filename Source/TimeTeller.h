@@ -3,52 +3,830 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <cstdio>
 
 #include "Log.h"
-#include "Misc.h"
+#include "TickClock.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+inline std::string escapeJson(const std::string& str)
+{
+    std::string ret;
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            ret.push_back('\\');
+            ret.push_back(c);
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+            ret += buf;
+        }
+        else
+            ret.push_back(c);
+    }
+    return ret;
+}
+
+// Log-linear histogram of durations, in the spirit of HdrHistogram.
+// Durations are counted in nanoseconds, each power of two is split into 32 linear
+// sub-buckets, so every value is known within 1/32 of itself, up to 2^45 ns (about 9.7 hours).
+// Memory is fixed whatever the number of samples, and histograms can be merged.
+// Counters are atomics updated with plain loads and stores: a histogram must only be
+// written by one thread, but can be read, e.g. merged into another one, from any thread
+// at the same time.
+class LatencyHistogram
+{
+public:
+    enum
+    {
+        SUB_BUCKET_BITS = 5,
+        SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+        MAX_EXPONENT = 44,
+        NUM_BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS
+    };
+
+    LatencyHistogram()
+    {
+        clear();
+    }
+
+    LatencyHistogram(const LatencyHistogram& other)
+    {
+        clear();
+        merge(other);
+    }
+
+    LatencyHistogram& operator=(const LatencyHistogram& other)
+    {
+        if (this != &other)
+        {
+            clear();
+            merge(other);
+        }
+        return *this;
+    }
+
+    void clear()
+    {
+        for (int i = 0; i < NUM_BUCKETS; i++)
+            counts[i].store(0, std::memory_order_relaxed);
+        num.store(0, std::memory_order_relaxed);
+        accum.store(0, std::memory_order_relaxed);
+        maxVal.store(0, std::memory_order_relaxed);
+    }
+
+    void record(double seconds)
+    {
+        double nanos = seconds * 1e9;
+        unsigned long long int val = nanos <= 0 ? 0 : (unsigned long long int)(nanos + 0.5);
+        add(counts[bucketOf(val)], 1);
+        add(num, 1);
+        accum.store(accum.load(std::memory_order_relaxed) + seconds, std::memory_order_relaxed);
+        if (seconds > maxVal.load(std::memory_order_relaxed))
+            maxVal.store(seconds, std::memory_order_relaxed);
+    }
+
+    void merge(const LatencyHistogram& other)
+    {
+        for (int i = 0; i < NUM_BUCKETS; i++)
+            add(counts[i], other.counts[i].load(std::memory_order_relaxed));
+        add(num, other.num.load(std::memory_order_relaxed));
+        accum.store(total() + other.total(), std::memory_order_relaxed);
+        maxVal.store(std::max(max(), other.max()), std::memory_order_relaxed);
+    }
+
+    // Keep only the samples recorded after older was taken as a copy of this histogram.
+    // The maximum of the remaining samples is estimated from their highest bucket.
+    void subtract(const LatencyHistogram& older)
+    {
+        if (older.count() > count())
+            return;
+
+        int highest = -1;
+        for (int i = 0; i < NUM_BUCKETS; i++)
+        {
+            unsigned long long int val = counts[i].load(std::memory_order_relaxed) -
+                std::min(counts[i].load(std::memory_order_relaxed), older.counts[i].load(std::memory_order_relaxed));
+            counts[i].store(val, std::memory_order_relaxed);
+            if (val)
+                highest = i;
+        }
+        num.store(count() - older.count(), std::memory_order_relaxed);
+        accum.store(std::max(total() - older.total(), 0.0), std::memory_order_relaxed);
+        maxVal.store(highest < 0 ? 0 : std::min(bucketUpper(highest) * 1e-9, max()), std::memory_order_relaxed);
+    }
+
+    unsigned long long int count() const
+    {
+        return num.load(std::memory_order_relaxed);
+    }
+
+    double total() const
+    {
+        return accum.load(std::memory_order_relaxed);
+    }
+
+    double max() const
+    {
+        return maxVal.load(std::memory_order_relaxed);
+    }
+
+    // Value in seconds below which a fraction p of the samples fall, 0 <= p <= 1.
+    double percentile(double p) const
+    {
+        unsigned long long int n = count();
+        if (n == 0)
+            return 0;
+
+        unsigned long long int rank = (unsigned long long int)(p * n + 0.5);
+        rank = std::min(std::max(rank, 1ULL), n);
+        unsigned long long int seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++)
+        {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(bucketMiddle(i) * 1e-9, max());
+        }
+        return max();
+    }
+
+private:
+    static void add(std::atomic<unsigned long long int>& counter, unsigned long long int val)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + val, std::memory_order_relaxed);
+    }
+
+    static int highestSetBit(unsigned long long int val)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, val);
+        return (int)index;
+#else
+        return 63 - __builtin_clzll(val);
+#endif
+    }
+
+    static int bucketOf(unsigned long long int val)
+    {
+        if (val < SUB_BUCKETS)
+            return (int)val;
+
+        int exponent = highestSetBit(val);
+        if (exponent > MAX_EXPONENT)
+        {
+            exponent = MAX_EXPONENT;
+            val = (2ULL << MAX_EXPONENT) - 1;
+        }
+        int shift = exponent - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int)((val >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static double bucketMiddle(int index)
+    {
+        if (index < SUB_BUCKETS)
+            return index;
+
+        int shift = index / SUB_BUCKETS - 1;
+        double lower = double((unsigned long long int)(SUB_BUCKETS + index % SUB_BUCKETS) << shift);
+        return lower + double(1ULL << shift) * 0.5;
+    }
+
+    static double bucketUpper(int index)
+    {
+        if (index < SUB_BUCKETS)
+            return index;
+
+        int shift = index / SUB_BUCKETS - 1;
+        return double((unsigned long long int)(SUB_BUCKETS + index % SUB_BUCKETS + 1) << shift);
+    }
+
+    std::atomic<unsigned long long int> counts[NUM_BUCKETS];
+    std::atomic<unsigned long long int> num;
+    std::atomic<double> accum;
+    std::atomic<double> maxVal;
+};
+
+// Label of an AutoTimer scope interned once by registerTimerSite, see AUTO_TIMER_SCOPE.
+struct TimerSite
+{
+    int id;
+};
+
+// A label always gets the same site, whether it is registered by several call sites or
+// recorded by string.
+class TimerSiteRegistry
+{
+public:
+    static TimerSite add(const std::string& label)
+    {
+        TimerSiteRegistry& registry = instance();
+        std::lock_guard<std::mutex> lg(registry.mtx);
+        TimerSite site;
+        std::unordered_map<std::string, int>::const_iterator itr = registry.ids.find(label);
+        if (itr != registry.ids.end())
+        {
+            site.id = itr->second;
+            return site;
+        }
+        site.id = (int)registry.labels.size();
+        registry.labels.push_back(label);
+        registry.ids.insert(std::make_pair(label, site.id));
+        return site;
+    }
+
+    static std::string label(int id)
+    {
+        TimerSiteRegistry& registry = instance();
+        std::lock_guard<std::mutex> lg(registry.mtx);
+        return registry.labels[id];
+    }
+
+private:
+    static TimerSiteRegistry& instance()
+    {
+        static TimerSiteRegistry registry;
+        return registry;
+    }
+
+    std::mutex mtx;
+    std::vector<std::string> labels;
+    std::unordered_map<std::string, int> ids;
+};
+
+inline TimerSite registerTimerSite(const char* label)
+{
+    return TimerSiteRegistry::add(label);
+}
+
+// Site of a label, interned through a cache of the calling thread, so that the registry
+// lock is only taken on the first use of a label in each thread.
+inline TimerSite internTimerLabel(const std::string& label)
+{
+    thread_local std::unordered_map<std::string, int> cache;
+    std::unordered_map<std::string, int>::const_iterator itr = cache.find(label);
+    if (itr == cache.end())
+        itr = cache.insert(std::make_pair(label, TimerSiteRegistry::add(label).id)).first;
+    TimerSite site;
+    site.id = itr->second;
+    return site;
+}
+
+// Node of the process-wide tree of traced scope stacks, one per distinct sequence of
+// sites from the outermost scope. The label and the ';'-joined stack path are built once
+// when a node is created. Children are an append-only lock-free list, so that lookups
+// never block. Nodes are never freed, there is one per distinct stack.
+struct TracePathNode
+{
+    TracePathNode(int siteId_, const std::string& label_, const std::string& path_) :
+        siteId(siteId_), label(label_), path(path_), children(0), sibling(0) {}
+
+    static TracePathNode* root()
+    {
+        static TracePathNode node(-1, std::string(), std::string());
+        return &node;
+    }
+
+    TracePathNode* child(int id)
+    {
+        TracePathNode* head = children.load(std::memory_order_acquire);
+        for (TracePathNode* node = head; node; node = node->sibling)
+        {
+            if (node->siteId == id)
+                return node;
+        }
+
+        std::string childLabel = TimerSiteRegistry::label(id);
+        TracePathNode* node = new TracePathNode(id, childLabel, siteId < 0 ? childLabel : path + ";" + childLabel);
+        node->sibling = head;
+        while (!children.compare_exchange_weak(node->sibling, node, std::memory_order_release, std::memory_order_acquire))
+        {
+            // Another thread may have added the same child meanwhile.
+            for (TracePathNode* other = node->sibling; other != head; other = other->sibling)
+            {
+                if (other->siteId == id)
+                {
+                    delete node;
+                    return other;
+                }
+            }
+            head = node->sibling;
+        }
+        return node;
+    }
+
+    const int siteId;
+    const std::string label;
+    const std::string path;
+
+private:
+    std::atomic<TracePathNode*> children;
+    TracePathNode* sibling;
+};
+
+// Samples are recorded into per-thread buffers, so AutoTimer scopes may run in any number
+// of threads without any lock on the hot path. Buffers and their label records are only
+// ever appended to lock-free lists, and each label has a LatencyHistogram per thread, so
+// getHistograms() and report() may run at any time, e.g. from AutoTimerExporter, without
+// blocking the recording threads.
+// By default every sample recorded by label is also kept, see getSamples(). With useHistogram
+// only histograms are kept, so memory stays bounded in long-running processes. Samples of
+// interned TimerSite labels only ever go to histograms.
+// With setTracing(true), every finished AutoTimer scope is also kept with its start time,
+// thread and position in the scope hierarchy, for exportChromeTrace and exportFoldedStacks.
+// getSamples(), the export functions and clear() must not run concurrently with recording,
+// e.g. call them after worker threads have been joined.
 class AutoTimerHandler
 {
 public:
+    AutoTimerHandler(bool useHistogram_ = false) :
+        id(nextHandlerId()), useHistogram(useHistogram_), tracing(false), buffers(0) {}
+
+    ~AutoTimerHandler()
+    {
+        ThreadBuffer* buffer = buffers.load(std::memory_order_acquire);
+        while (buffer)
+        {
+            ThreadBuffer* next = buffer->next;
+            LabelRecord* rec = buffer->records.load(std::memory_order_acquire);
+            while (rec)
+            {
+                LabelRecord* nextRec = rec->next;
+                delete rec;
+                rec = nextRec;
+            }
+            delete buffer;
+            buffer = next;
+        }
+    }
+
+    // The label is interned on its first use in each thread, then found by a hash lookup
+    // in a per-thread cache, without taking the registry lock, and recorded into the slot
+    // of its site.
     void record(const std::string& label, double t)
     {
-        std::map<std::string, std::vector<double> >::iterator itr =
-            mapLabelToValues.find(label);
-        if (itr != mapLabelToValues.end())
+        ThreadBuffer* buffer = localBuffer();
+        std::unordered_map<std::string, int>::const_iterator itr = buffer->labelSites.find(label);
+        if (itr == buffer->labelSites.end())
+            itr = buffer->labelSites.insert(std::make_pair(label, TimerSiteRegistry::add(label).id)).first;
+        addSample(*siteRecord(buffer, itr->second), t);
+    }
+
+    // Record into the slot of an interned label, without any string lookup. Only the
+    // fixed-size histogram is updated, whatever useHistogram, so that this path does not
+    // allocate once the slot exists.
+    void record(TimerSite site, double t)
+    {
+        siteRecord(localBuffer(), site.id)->hist.record(t);
+    }
+
+    bool usesHistogram() const
+    {
+        return useHistogram;
+    }
+
+    void setTracing(bool enable)
+    {
+        tracing.store(enable, std::memory_order_relaxed);
+    }
+
+    bool isTracing() const
+    {
+        return tracing.load(std::memory_order_relaxed);
+    }
+
+    // Record a finished scope. node identifies the scope and the stack of its enclosing
+    // scopes, start is in seconds on the tick clock, and selfTime is duration minus the
+    // time spent in child scopes.
+    void recordTrace(const TracePathNode* node, double start, double duration, double selfTime)
+    {
+        ThreadBuffer* buffer = localBuffer();
+        TraceEvent event;
+        event.node = node;
+        event.start = start;
+        event.duration = duration;
+        buffer->events.push_back(event);
+        buffer->selfTimes[node] += selfTime;
+    }
+
+    void clear()
+    {
+        for (ThreadBuffer* buffer = buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
         {
-            itr->second.push_back(t);
+            for (LabelRecord* rec = buffer->records.load(std::memory_order_acquire); rec; rec = rec->next)
+            {
+                rec->hist.clear();
+                rec->values.clear();
+            }
+            buffer->events.clear();
+            buffer->selfTimes.clear();
         }
-        else
+    }
+
+    // Merge the histograms of all threads into hists, adding to what hists already contains,
+    // so that histograms of several handlers can be combined.
+    void getHistograms(std::map<std::string, LatencyHistogram>& hists) const
+    {
+        for (const ThreadBuffer* buffer = buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
         {
-            std::vector<double> vals;
-            vals.push_back(t);
-            mapLabelToValues.insert(std::make_pair(label, vals));
+            for (const LabelRecord* rec = buffer->records.load(std::memory_order_acquire); rec; rec = rec->next)
+                hists[rec->label].merge(rec->hist);
         }
     }
 
-    void clear()
+    // Every sample recorded by label in every thread, empty with useHistogram.
+    void getSamples(std::map<std::string, std::vector<double> >& samples) const
     {
-        mapLabelToValues.clear();
+        for (const ThreadBuffer* buffer = buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
+        {
+            for (const LabelRecord* rec = buffer->records.load(std::memory_order_acquire); rec; rec = rec->next)
+            {
+                std::vector<double>& vals = samples[rec->label];
+                vals.insert(vals.end(), rec->values.begin(), rec->values.end());
+            }
+        }
     }
 
     void report() const
+    {
+        std::map<std::string, LatencyHistogram> hists;
+        getHistograms(hists);
+        report(hists);
+    }
+
+    // Write traced scopes as Chrome Trace Event JSON, to be opened in chrome://tracing
+    // or https://ui.perfetto.dev.
+    bool exportChromeTrace(const std::string& path) const
+    {
+        std::ofstream ofs(path);
+        if (!ofs)
+            return false;
+
+        ofs << std::fixed << std::setprecision(3);
+        ofs << "{\"traceEvents\":[";
+        bool first = true;
+        for (const ThreadBuffer* buffer = buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
+        {
+            for (const TraceEvent& event : buffer->events)
+            {
+                ofs << (first ? "\n" : ",\n");
+                ofs << "{\"name\":\"" << escapeJson(event.node->label) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                    << buffer->threadIndex << ",\"ts\":" << event.start * 1e6 << ",\"dur\":" << event.duration * 1e6 << "}";
+                first = false;
+            }
+        }
+        ofs << "\n],\"displayTimeUnit\":\"ms\"}\n";
+        return (bool)ofs;
+    }
+
+    // Write traced scopes as folded stacks, one "outer;inner;leaf <self time in us>" line per
+    // distinct stack, merged over threads, the input format of flamegraph.pl and speedscope.
+    bool exportFoldedStacks(const std::string& path) const
+    {
+        std::map<std::string, double> mapPathToSelfTime;
+        for (const ThreadBuffer* buffer = buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
+        {
+            for (std::unordered_map<const TracePathNode*, double>::const_iterator itr = buffer->selfTimes.cbegin(),
+                itrEnd = buffer->selfTimes.cend(); itr != itrEnd; ++itr)
+                mapPathToSelfTime[itr->first->path] += itr->second;
+        }
+
+        std::ofstream ofs(path);
+        if (!ofs)
+            return false;
+        for (std::map<std::string, double>::const_iterator itr = mapPathToSelfTime.cbegin(),
+            itrEnd = mapPathToSelfTime.cend(); itr != itrEnd; ++itr)
+            ofs << itr->first << " " << (long long int)(itr->second * 1e6 + 0.5) << "\n";
+        return (bool)ofs;
+    }
+
+    static void report(const std::map<std::string, LatencyHistogram>& hists)
     {
         LOG_INFO("Begin:");
-        for (std::map<std::string, std::vector<double> >::const_iterator itr = mapLabelToValues.cbegin(), itrEnd = mapLabelToValues.cend();
+        for (std::map<std::string, LatencyHistogram>::const_iterator itr = hists.cbegin(), itrEnd = hists.cend();
             itr != itrEnd; ++itr)
         {
-            const std::vector<double>& vals = itr->second;
-            int count = (int)vals.size();
-            double accum = 0;
-            for (int i = 0; i < count; i++)
-                accum += vals[i];
-            LOG_INFO("{}: total {}, count {}, avg {}", itr->first, accum, count, count == 0 ? accum : accum / count);
+            const LatencyHistogram& hist = itr->second;
+            double accum = hist.total();
+            int count = (int)hist.count();
+            LOG_INFO("{}: total {}, count {}, avg {}, p50 {}, p90 {}, p99 {}, p999 {}, max {}",
+                itr->first, accum, count, count == 0 ? accum : accum / count,
+                hist.percentile(0.5), hist.percentile(0.9), hist.percentile(0.99), hist.percentile(0.999), hist.max());
         }
         LOG_INFO("End");
     }
 
 private:
-    std::map<std::string, std::vector<double> > mapLabelToValues;
+    AutoTimerHandler(const AutoTimerHandler&);
+    AutoTimerHandler& operator=(const AutoTimerHandler&);
+
+    // Statistics of one label in one thread. The label is set before the record is
+    // published, and never changes afterwards.
+    struct LabelRecord
+    {
+        std::string label;
+        LatencyHistogram hist;
+        std::vector<double> values;
+        LabelRecord* next;
+    };
+
+    void addSample(LabelRecord& rec, double t)
+    {
+        rec.hist.record(t);
+        if (!useHistogram)
+            rec.values.push_back(t);
+    }
+
+    struct TraceEvent
+    {
+        const TracePathNode* node;
+        double start;
+        double duration;
+    };
+
+    struct ThreadBuffer
+    {
+        std::atomic<LabelRecord*> records;
+        // Site ids of the labels recorded by string, used by the owner thread only.
+        std::unordered_map<std::string, int> labelSites;
+        // Indexed by TimerSite::id.
+        std::vector<LabelRecord*> sites;
+        std::vector<TraceEvent> events;
+        std::unordered_map<const TracePathNode*, double> selfTimes;
+        int threadIndex;
+        ThreadBuffer* next;
+    };
+
+    // Only the owner thread of buffer appends to its records.
+    static LabelRecord* addRecord(ThreadBuffer* buffer, const std::string& label)
+    {
+        LabelRecord* rec = new LabelRecord;
+        rec->label = label;
+        rec->next = buffer->records.load(std::memory_order_relaxed);
+        buffer->records.store(rec, std::memory_order_release);
+        return rec;
+    }
+
+    static LabelRecord* siteRecord(ThreadBuffer* buffer, int id)
+    {
+        std::vector<LabelRecord*>& sites = buffer->sites;
+        if (id >= (int)sites.size())
+            sites.resize(id + 1, 0);
+        if (!sites[id])
+            sites[id] = addRecord(buffer, TimerSiteRegistry::label(id));
+        return sites[id];
+    }
+
+    // Small sequential thread ids, more readable than native ones in trace viewers.
+    static int currentThreadIndex()
+    {
+        static std::atomic<int> counter(0);
+        thread_local int index = ++counter;
+        return index;
+    }
+
+    static unsigned long long int nextHandlerId()
+    {
+        static std::atomic<unsigned long long int> counter(0);
+        return ++counter;
+    }
+
+    ThreadBuffer* localBuffer()
+    {
+        // Handler ids are never reused, so entries left by destroyed handlers never match.
+        thread_local std::vector<std::pair<unsigned long long int, ThreadBuffer*> > localBuffers;
+        for (const std::pair<unsigned long long int, ThreadBuffer*>& entry : localBuffers)
+        {
+            if (entry.first == id)
+                return entry.second;
+        }
+
+        ThreadBuffer* buffer = new ThreadBuffer;
+        buffer->records.store(0, std::memory_order_relaxed);
+        buffer->threadIndex = currentThreadIndex();
+        buffer->next = buffers.load(std::memory_order_relaxed);
+        while (!buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        localBuffers.push_back(std::make_pair(id, buffer));
+        return buffer;
+    }
+
+    const unsigned long long int id;
+    const bool useHistogram;
+    std::atomic<bool> tracing;
+    std::atomic<ThreadBuffer*> buffers;
+};
+
+// Periodically publish the statistics of an AutoTimerHandler while the process keeps running.
+// Every interval, the histograms of the handler are merged and the samples recorded since
+// the previous publication are written out as a Prometheus text exposition file, e.g. for
+// the node_exporter textfile collector, and / or a JSON file, with count, sum and p50, p90,
+// p99, p999 and max in seconds per label.
+// In the Prometheus file, quantiles and max cover the last interval, while the _sum and
+// _count of the summary are totals since the start, as Prometheus expects of counters.
+// Files are written to a temporary file first and renamed, so readers never see a partial
+// file. Recording threads are never blocked, the exporter only reads their histograms.
+class AutoTimerExporter
+{
+public:
+    AutoTimerExporter(const AutoTimerHandler& handler_, const std::string& prometheusPath_,
+        const std::string& jsonPath_ = std::string(), double intervalSeconds_ = 10) :
+        handler(handler_), prometheusPath(prometheusPath_), jsonPath(jsonPath_),
+        intervalSeconds(intervalSeconds_), running(false), lastTime(getTicks()) {}
+
+    ~AutoTimerExporter()
+    {
+        stop();
+    }
+
+    bool start()
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        if (running)
+            return false;
+        running = true;
+        thread = std::thread(&AutoTimerExporter::run, this);
+        return true;
+    }
+
+    // Stop the thread, after a final publication.
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lg(mtx);
+            if (!running)
+                return;
+            running = false;
+        }
+        cv.notify_all();
+        thread.join();
+        publish();
+    }
+
+    // Write the samples recorded since the previous call, return false if a file could not be written.
+    bool publish()
+    {
+        std::lock_guard<std::mutex> lg(publishMtx);
+        std::map<std::string, LatencyHistogram> hists;
+        handler.getHistograms(hists);
+
+        long long int now = getTicks();
+        double interval = ticksToSeconds(now - lastTime);
+        lastTime = now;
+
+        std::map<std::string, LatencyHistogram> deltas(hists);
+        for (std::map<std::string, LatencyHistogram>::iterator itr = deltas.begin(), itrEnd = deltas.end();
+            itr != itrEnd; ++itr)
+        {
+            std::map<std::string, LatencyHistogram>::const_iterator itrPrev = prevHists.find(itr->first);
+            if (itrPrev != prevHists.end())
+                itr->second.subtract(itrPrev->second);
+        }
+        prevHists.swap(hists);
+
+        bool ok = true;
+        if (!prometheusPath.empty())
+            ok = writePrometheus(deltas, prevHists, interval) && ok;
+        if (!jsonPath.empty())
+            ok = writeJson(deltas, interval) && ok;
+        return ok;
+    }
+
+private:
+    AutoTimerExporter(const AutoTimerExporter&);
+    AutoTimerExporter& operator=(const AutoTimerExporter&);
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (running)
+        {
+            if (cv.wait_for(lock, std::chrono::duration<double>(intervalSeconds), [this] { return !running; }))
+                break;
+            lock.unlock();
+            if (!publish())
+                LOG_WARNING("AutoTimerExporter failed to write {} {}", prometheusPath, jsonPath);
+            lock.lock();
+        }
+    }
+
+    static std::string escapePrometheus(const std::string& str)
+    {
+        std::string ret;
+        for (char c : str)
+        {
+            if (c == '"' || c == '\\')
+            {
+                ret.push_back('\\');
+                ret.push_back(c);
+            }
+            else if (c == '\n')
+                ret += "\\n";
+            else
+                ret.push_back(c);
+        }
+        return ret;
+    }
+
+    static bool replaceFile(const std::string& tempPath, const std::string& path)
+    {
+#ifdef _WIN32
+        std::remove(path.c_str());
+#endif
+        return std::rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+
+    bool writePrometheus(const std::map<std::string, LatencyHistogram>& hists,
+        const std::map<std::string, LatencyHistogram>& totals, double interval) const
+    {
+        static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        std::string tempPath = prometheusPath + ".tmp";
+        {
+            std::ofstream ofs(tempPath);
+            if (!ofs)
+                return false;
+            ofs << std::setprecision(9);
+            ofs << "# HELP autotimer_interval_seconds Length of the interval the samples were recorded in.\n"
+                << "# TYPE autotimer_interval_seconds gauge\n"
+                << "autotimer_interval_seconds " << interval << "\n"
+                << "# HELP autotimer_seconds Duration of AutoTimer scopes, quantiles over the last interval, sum and count since the start.\n"
+                << "# TYPE autotimer_seconds summary\n";
+            for (std::map<std::string, LatencyHistogram>::const_iterator itr = hists.cbegin(), itrEnd = hists.cend();
+                itr != itrEnd; ++itr)
+            {
+                std::string label = escapePrometheus(itr->first);
+                const LatencyHistogram& hist = itr->second;
+                const LatencyHistogram& total = totals.find(itr->first)->second;
+                for (double q : quantiles)
+                    ofs << "autotimer_seconds{label=\"" << label << "\",quantile=\"" << q << "\"} " << hist.percentile(q) << "\n";
+                ofs << "autotimer_seconds_sum{label=\"" << label << "\"} " << total.total() << "\n"
+                    << "autotimer_seconds_count{label=\"" << label << "\"} " << total.count() << "\n";
+            }
+            ofs << "# HELP autotimer_max_seconds Longest AutoTimer scope recorded in the last interval.\n"
+                << "# TYPE autotimer_max_seconds gauge\n";
+            for (std::map<std::string, LatencyHistogram>::const_iterator itr = hists.cbegin(), itrEnd = hists.cend();
+                itr != itrEnd; ++itr)
+                ofs << "autotimer_max_seconds{label=\"" << escapePrometheus(itr->first) << "\"} " << itr->second.max() << "\n";
+            if (!ofs.flush())
+                return false;
+        }
+        return replaceFile(tempPath, prometheusPath);
+    }
+
+    bool writeJson(const std::map<std::string, LatencyHistogram>& hists, double interval) const
+    {
+        std::string tempPath = jsonPath + ".tmp";
+        {
+            std::ofstream ofs(tempPath);
+            if (!ofs)
+                return false;
+            ofs << std::setprecision(9);
+            ofs << "{\"interval\":" << interval << ",\"timestamp\":" << (long long int)std::time(0) << ",\"timers\":{";
+            bool first = true;
+            for (std::map<std::string, LatencyHistogram>::const_iterator itr = hists.cbegin(), itrEnd = hists.cend();
+                itr != itrEnd; ++itr)
+            {
+                const LatencyHistogram& hist = itr->second;
+                ofs << (first ? "\n" : ",\n");
+                ofs << "\"" << escapeJson(itr->first) << "\":{\"count\":" << hist.count() << ",\"sum\":" << hist.total()
+                    << ",\"p50\":" << hist.percentile(0.5) << ",\"p90\":" << hist.percentile(0.9)
+                    << ",\"p99\":" << hist.percentile(0.99) << ",\"p999\":" << hist.percentile(0.999)
+                    << ",\"max\":" << hist.max() << "}";
+                first = false;
+            }
+            ofs << "\n}}\n";
+            if (!ofs.flush())
+                return false;
+        }
+        return replaceFile(tempPath, jsonPath);
+    }
+
+    const AutoTimerHandler& handler;
+    std::string prometheusPath, jsonPath;
+    double intervalSeconds;
+    bool running;
+    std::mutex mtx, publishMtx;
+    std::condition_variable cv;
+    std::thread thread;
+    long long int lastTime;
+    std::map<std::string, LatencyHistogram> prevHists;
 };
 
 extern AutoTimerHandler autoTimerHandler;
@@ -57,23 +835,126 @@ class AutoTimer
 {
 public:
     AutoTimer(const char* label_, AutoTimerHandler* handler_ = 0, bool printWhenDestruct_ = false) : 
-        label(label_), handler(handler_), printWhenDestruct(printWhenDestruct_) {}
+        label(label_), handler(handler_), printWhenDestruct(printWhenDestruct_)
+    {
+        site.id = -1;
+        enter();
+    }
     
     AutoTimer(const std::string& label_, AutoTimerHandler* handler_ = 0, bool printWhenDestruct_ = false) :
-        label(label_), handler(handler_), printWhenDestruct(printWhenDestruct_) {}
+        label(label_), handler(handler_), printWhenDestruct(printWhenDestruct_)
+    {
+        site.id = -1;
+        enter();
+    }
+
+    // No allocation nor string lookup, the label is only looked up for tracing and printing.
+    AutoTimer(TimerSite site_, AutoTimerHandler* handler_ = 0, bool printWhenDestruct_ = false) :
+        site(site_), handler(handler_), printWhenDestruct(printWhenDestruct_)
+    {
+        enter();
+    }
 
     ~AutoTimer()
     {
         t.end();
+        leave();
         if (handler)
-            handler->record(label, t.elapsed());
+        {
+            if (site.id >= 0)
+                handler->record(site, t.elapsed());
+            else
+                handler->record(label, t.elapsed());
+        }
         if (printWhenDestruct)
-            LOG_INFO("Time elapsed in {}: {}", label, t.elapsed());
+            LOG_INFO("Time elapsed in {}: {}", getLabel(), t.elapsed());
     }
 
 private:
+    AutoTimer(const AutoTimer&);
+    AutoTimer& operator=(const AutoTimer&);
+
+    // Innermost live AutoTimer of the calling thread, scopes form a stack through parent.
+    static AutoTimer*& currentScope()
+    {
+        thread_local AutoTimer* current = 0;
+        return current;
+    }
+
+    void enter()
+    {
+        AutoTimer*& current = currentScope();
+        parent = current;
+        current = this;
+        childTime = 0;
+        traceNode = 0;
+        traced = handler && handler->isTracing();
+        if (traced)
+            startTime = ticksToSeconds(getTicks());
+    }
+
+    std::string getLabel() const
+    {
+        return site.id >= 0 ? TimerSiteRegistry::label(site.id) : label;
+    }
+
+    // Node of the stack of live scopes ending with this one, looked up once per scope, and
+    // only for traced scopes and their ancestors.
+    TracePathNode* tracePath()
+    {
+        if (!traceNode)
+        {
+            TracePathNode* base = parent ? parent->tracePath() : TracePathNode::root();
+            traceNode = base->child(site.id >= 0 ? site.id : internTimerLabel(label).id);
+        }
+        return traceNode;
+    }
+
+    // Scopes are expected to end in the reverse order they began. A timer destroyed out of
+    // order, e.g. allocated on the heap, is unlinked from the stack of the thread without
+    // touching its enclosing scopes, so that no scope keeps a pointer to it. Timers must be
+    // destroyed by the thread which created them.
+    void leave()
+    {
+        double elapsed = t.elapsed();
+        if (traced)
+            handler->recordTrace(tracePath(), startTime, elapsed, std::max(elapsed - childTime, 0.0));
+
+        AutoTimer*& current = currentScope();
+        if (current == this)
+        {
+            current = parent;
+            if (parent)
+                parent->childTime += elapsed;
+            return;
+        }
+        for (AutoTimer* scope = current; scope; scope = scope->parent)
+        {
+            if (scope->parent == this)
+            {
+                scope->parent = parent;
+                break;
+            }
+        }
+    }
+
     Timer t;
     std::string label;
+    TimerSite site;
     AutoTimerHandler* handler;
     bool printWhenDestruct;
-};
\ No newline at end of file
+    AutoTimer* parent;
+    TracePathNode* traceNode;
+    double childTime;
+    double startTime;
+    bool traced;
+};
+
+#define AUTO_TIMER_CAT_HELPER(a, b) a##b
+#define AUTO_TIMER_CAT(a, b) AUTO_TIMER_CAT_HELPER(a, b)
+
+// Time the rest of the enclosing scope, the label is interned once per call site, e.g.
+// AUTO_TIMER_SCOPE("detect", &autoTimerHandler);
+#define AUTO_TIMER_SCOPE(label, handler) \
+    static const TimerSite AUTO_TIMER_CAT(autoTimerSite_, __LINE__) = registerTimerSite(label); \
+    AutoTimer AUTO_TIMER_CAT(autoTimer_, __LINE__)(AUTO_TIMER_CAT(autoTimerSite_, __LINE__), handler)